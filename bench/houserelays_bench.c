@@ -0,0 +1,394 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_bench.c - Measure the cost of the HouseRelays hot paths.
+ *
+ * This program links the HouseRelays modules, with the GPIO simulator
+ * instead of the hardware, and measures the cost of their most frequent
+ * operations.
+ * The results are printed as one JSON object per line, for example:
+ *
+ *    {"case":"index.search","points":8,"ns":21.4}
+ *
+ * The cases are:
+ *
+ *    index: search a point by name.
+ *
+ *    memory: store one change in the history ring, and export the history
+ *    depending on how full the ring is and on the since position (all the
+ *    ring, its second half, or only the last change).
+ *
+ *    scan: one input scan by houserelays_gpio_scanner(), reading the
+ *    inputs from the GPIO simulator, detecting the changes and storing
+ *    them in the history, for 8 to 1024 inputs, idle or changing.
+ *
+ * SYNOPSYS:
+ *
+ *    houserelays_bench [case ..]
+ *
+ *    Run the listed cases, or all cases if none is listed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "houseconfig.h"
+
+#include "houserelays_index.h"
+#include "houserelays_writer.h"
+#include "houserelays_memory.h"
+#include "houserelays_timer.h"
+#include "houserelays_gpio.h"
+
+static volatile int BenchSink; // Prevent the compiler from removing code.
+
+static const int BenchSizes[] = {8, 32, 128, 512, 1000, 0};
+
+static long long bench_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (1000000000LL * now.tv_sec) + now.tv_nsec;
+}
+
+static void bench_report (const char *name, const char *parameters,
+                          long long elapsed, long long operations) {
+    printf ("{\"case\":\"%s\",%s,\"ns\":%.1f}\n",
+            name, parameters, (double)elapsed / operations);
+    fflush (stdout);
+}
+
+static long long bench_timestamp (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    return (1000LL * now.tv_sec) + now.tv_nsec / 1000000;
+}
+
+static char **bench_names (int count) {
+
+    char **names = calloc (count, sizeof(char *));
+    int i;
+    for (i = 0; i < count; ++i) {
+        char buffer[32];
+        snprintf (buffer, sizeof(buffer), "point%d", i);
+        names[i] = strdup (buffer);
+    }
+    return names;
+}
+
+static void bench_free (char **names, int count) {
+    int i;
+    for (i = 0; i < count; ++i) free (names[i]);
+    free (names);
+}
+
+// Point search by name: the hash index, with a linear search for reference.
+//
+static void bench_index (void) {
+
+    const int rounds = 200000;
+
+    int s;
+    for (s = 0; BenchSizes[s]; ++s) {
+        int count = BenchSizes[s];
+        char **names = bench_names (count);
+
+        RelaysIndex index = {0, 0};
+        houserelays_index_reset (&index, count);
+        int i;
+        for (i = 0; i < count; ++i) houserelays_index_add (&index, names[i], i);
+
+        char parameters[64];
+        snprintf (parameters, sizeof(parameters), "\"points\":%d", count);
+
+        long long start = bench_now ();
+        for (i = 0; i < rounds; ++i) {
+            BenchSink = houserelays_index_search (&index, names[i % count]);
+        }
+        bench_report ("index.search", parameters, bench_now() - start, rounds);
+
+        start = bench_now ();
+        for (i = 0; i < rounds; ++i) {
+            const char *name = names[i % count];
+            int j;
+            for (j = 0; j < count; ++j) {
+                if (!strcmp (names[j], name)) break;
+            }
+            BenchSink = j;
+        }
+        bench_report ("index.linear", parameters, bench_now() - start, rounds);
+
+        bench_free (names, count);
+    }
+}
+
+// The history ring: cost of storing one change, and cost of exporting
+// the history depending on the ring fill and the since position.
+//
+static const int BenchDepths[] = {1024, 16384, 0};
+static const int BenchFills[] = {25, 50, 100, 0}; // Percent.
+
+#define BENCH_HISTORY_POINTS 32
+
+static void bench_history_setup (int depth, char **names) {
+
+    char option[64];
+    const char *argv[2] = {"bench", option};
+    snprintf (option, sizeof(option), "-history-depth=%d", depth);
+    houserelays_memory_initialize (2, argv);
+
+    houserelays_memory_reset (BENCH_HISTORY_POINTS, 10);
+    int i;
+    for (i = 0; i < BENCH_HISTORY_POINTS; ++i)
+        houserelays_memory_add (names[i], 0);
+}
+
+static long long bench_history_fill (int count, long long timestamp) {
+
+    // One change every 10 ms, cycling through the points.
+    int i;
+    for (i = 0; i < count; ++i) {
+        int point = i % BENCH_HISTORY_POINTS;
+        int state = (i / BENCH_HISTORY_POINTS) & 1;
+        houserelays_memory_store (timestamp, point, state);
+        houserelays_memory_done (timestamp);
+        timestamp += 10;
+    }
+    return timestamp;
+}
+
+static void bench_memory (void) {
+
+    static const char *positions[] = {"all", "half", "last", 0};
+
+    char **names = bench_names (BENCH_HISTORY_POINTS);
+    RelaysWriter writer = {0};
+
+    int d;
+    for (d = 0; BenchDepths[d]; ++d) {
+        int depth = BenchDepths[d];
+        char parameters[128];
+
+        // Storing: the ring is full most of the time, so that the cost
+        // includes the eviction of the oldest change.
+        bench_history_setup (depth, names);
+        int rounds = 2000000;
+        long long timestamp = bench_timestamp ();
+        long long start = bench_now ();
+        bench_history_fill (rounds, timestamp);
+        snprintf (parameters, sizeof(parameters), "\"depth\":%d", depth);
+        bench_report ("memory.store", parameters, bench_now() - start, rounds);
+
+        int f;
+        for (f = 0; BenchFills[f]; ++f) {
+            int count = ((depth - 1) * BenchFills[f]) / 100;
+            bench_history_setup (depth, names);
+            timestamp = bench_timestamp () - (10LL * count);
+            long long first = timestamp;
+            bench_history_fill (count, timestamp);
+
+            int p;
+            for (p = 0; positions[p]; ++p) {
+                long long since = 0;
+                if (p == 1) since = first + (5LL * count);
+                else if (p == 2) since = first + (10LL * (count - 2));
+
+                int packed;
+                for (packed = 0; packed <= 1; ++packed) {
+                    rounds = 1 + 4000000 / (count + 64);
+                    int i;
+                    start = bench_now ();
+                    for (i = 0; i < rounds; ++i) {
+                        houserelays_writer_start (&writer);
+                        houserelays_writer_object (&writer, 0);
+                        houserelays_memory_history
+                            (since, 0, packed, &writer);
+                        BenchSink = houserelays_writer_length (&writer);
+                    }
+                    snprintf (parameters, sizeof(parameters),
+                              "\"depth\":%d,\"fill\":%d,\"since\":\"%s\","
+                              "\"format\":\"%s\",\"bytes\":%d",
+                              depth, BenchFills[f], positions[p],
+                              packed ? "packed" : "json", BenchSink);
+                    bench_report ("memory.history", parameters,
+                                  bench_now() - start, rounds);
+                }
+            }
+        }
+    }
+    bench_free (names, BENCH_HISTORY_POINTS);
+}
+
+// The input scan: houserelays_gpio_scanner() itself, run through the
+// houserelays_gpio_scan() hook, reading the inputs from the GPIO simulator.
+// The inputs of one chip never change, while the inputs of another chip
+// follow a waveform with one change every 10 microseconds. The history
+// is recorded, as when a client requested fast scanning. The archive
+// is not enabled.
+//
+static const int BenchScanSizes[] = {8, 32, 128, 512, 1024, 0};
+
+#define BENCH_SCAN_IDLE 15 // A chip without waveform.
+#define BENCH_SCAN_STEP 0.01 // Milliseconds between two input changes.
+#define BENCH_SCAN_CHANGES 2048 // Per waveform period, for all sizes.
+
+static char BenchDirectory[] = "/tmp/houserelays_bench.XXXXXX";
+
+static void bench_scan_waveform (const char *path) {
+
+    // Each size uses its own chip, so that the simulator plays only
+    // the changes of the inputs being scanned. The inputs are set, then
+    // cleared, one after the other, until the end of the period.
+    FILE *file = fopen (path, "w");
+    if (!file) return;
+    int s;
+    for (s = 0; BenchScanSizes[s]; ++s) {
+        int count = BenchScanSizes[s];
+        int i;
+        for (i = 0; i < BENCH_SCAN_CHANGES; ++i) {
+            fprintf (file, "%.3f %d %d %d\n", i * BENCH_SCAN_STEP,
+                     s, i % count, ((i / count) & 1) == 0);
+        }
+    }
+    fprintf (file, "repeat %.3f\n", BENCH_SCAN_CHANGES * BENCH_SCAN_STEP);
+    fclose (file);
+}
+
+static char *bench_scan_config (int chip, int count) {
+
+    int size = 64 + (80 * count);
+    char *config = malloc (size);
+    int length = snprintf (config, size,
+                           "{\"relays\":{\"iochip\":%d,\"points\":[", chip);
+    int i;
+    for (i = 0; i < count; ++i) {
+        length += snprintf (config + length, size - length,
+                            "%s{\"name\":\"point%d\",\"mode\":\"input\","
+                            "\"gpio\":%d,\"on\":1}",
+                            i ? "," : "", i, i);
+    }
+    snprintf (config + length, size - length, "]}}");
+    return config;
+}
+
+static const char *bench_scan_refresh (void) {
+    return houserelays_gpio_refresh ();
+}
+
+static void bench_scan (void) {
+
+    const int rounds = 100000;
+
+    if (!mkdtemp (BenchDirectory)) return;
+
+    char waveform[128];
+    char waveformoption[160];
+    snprintf (waveform, sizeof(waveform), "%s/waveform.txt", BenchDirectory);
+    snprintf (waveformoption, sizeof(waveformoption),
+              "-simulator-waveform=%s", waveform);
+    bench_scan_waveform (waveform);
+
+    // The configuration file is the initial configuration. The following
+    // ones are applied as if changed by the user.
+    char path[128];
+    char configoption[160];
+    snprintf (path, sizeof(path), "%s/relays.json", BenchDirectory);
+    snprintf (configoption, sizeof(configoption), "-config=%s", path);
+    char *config = bench_scan_config (BENCH_SCAN_IDLE, BenchScanSizes[0]);
+    FILE *file = fopen (path, "w");
+    if (file) {
+        fputs (config, file);
+        fclose (file);
+    }
+    free (config);
+
+    const char *argv[] = {"bench", "-history-depth=1024", "-gpio=simulator",
+                          waveformoption, configoption};
+    int argc = sizeof(argv) / sizeof(argv[0]);
+
+    houserelays_timer_initialize ();
+    houserelays_memory_initialize (argc, argv);
+    houseconfig_initialize ("relays", bench_scan_refresh, argc, argv);
+    const char *error = houserelays_gpio_initialize (argc, argv);
+    if (error) {
+        fprintf (stderr, "cannot configure the simulator: %s\n", error);
+        return;
+    }
+
+    int s;
+    for (s = 0; BenchScanSizes[s]; ++s) {
+        int count = BenchScanSizes[s];
+
+        // No activity, then one input change every 10 microseconds.
+        int busy;
+        for (busy = 0; busy <= 1; ++busy) {
+
+            config = bench_scan_config (busy ? s : BENCH_SCAN_IDLE, count);
+            error = houseconfig_update (config, "BENCH");
+            free (config);
+            if (error) {
+                fprintf (stderr, "cannot configure %d inputs: %s\n",
+                         count, error);
+                continue;
+            }
+            houserelays_gpio_fast ("bench", 10);
+
+            int r;
+            long long start = bench_now ();
+            for (r = 0; r < rounds; ++r) houserelays_gpio_scan ();
+
+            char parameters[64];
+            snprintf (parameters, sizeof(parameters),
+                      "\"inputs\":%d,\"changes_per_ms\":%d",
+                      count, busy ? (int)(1 / BENCH_SCAN_STEP) : 0);
+            bench_report ("scan", parameters, bench_now() - start, rounds);
+        }
+    }
+    unlink (path);
+    unlink (waveform);
+    rmdir (BenchDirectory);
+}
+
+static struct {
+    const char *name;
+    void (*run) (void);
+} BenchCases[] = {
+    {"index", bench_index},
+    {"memory", bench_memory},
+    {"scan", bench_scan},
+    {0, 0}
+};
+
+int main (int argc, const char **argv) {
+
+    int i;
+    for (i = 0; BenchCases[i].name; ++i) {
+        if (argc > 1) {
+            int j;
+            for (j = 1; j < argc; ++j) {
+                if (!strcmp (argv[j], BenchCases[i].name)) break;
+            }
+            if (j >= argc) continue;
+        }
+        BenchCases[i].run ();
+    }
+    return 0;
+}
@@ -0,0 +1,346 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_load.c - Measure how many web requests HouseRelays can serve.
+ *
+ * This program sends requests to a running HouseRelays service, through
+ * a number of concurrent connections, and measures the throughput and
+ * latency. Each URI is measured on its own, one after the other. The
+ * results are printed as one JSON object per URI, for example:
+ *
+ *    {"case":"http","uri":"/relays/status","concurrency":8,"requests":41250,
+ *     "rps":8250.0,"p50_us":910,"p99_us":2380,"cpu_us":95.2}
+ *
+ * If the process ID of the service is provided, the CPU time used by the
+ * service is measured and reported per request (cpu_us).
+ *
+ * SYNOPSYS:
+ *
+ *    houserelays_load [-port=N] [-concurrency=N] [-duration=S] [-pid=N]
+ *                     [-point=NAME] [uri ..]
+ *
+ *    Measure each listed URI, or /relays/status, /relays/set and
+ *    /relays/history if none is listed. The set requests alternate
+ *    between on and off for the named point. The history requests ask
+ *    for the last second of changes.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LOAD_CONNECTIONS_MAX 256
+
+static int LoadPort = 8080;
+static int LoadConcurrency = 8;
+static int LoadDuration = 5; // Seconds per URI.
+static int LoadPid = 0;
+static const char *LoadPoint = "point0";
+
+struct LoadConnection {
+    int fd;
+    int sent;       // Number of bytes of the request already sent.
+    int length;     // Length of the request.
+    int received;   // Number of bytes of the response received.
+    long long start;
+    char request[512];
+    char response[65536];
+};
+
+static struct LoadConnection LoadConnections[LOAD_CONNECTIONS_MAX];
+
+static int *LoadLatency = 0; // Microseconds.
+static int LoadLatencyCount = 0;
+static int LoadLatencySize = 0;
+static int LoadErrors = 0;
+static int LoadToggle = 0;
+
+static long long load_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (1000000LL * now.tv_sec) + now.tv_nsec / 1000;
+}
+
+static long long load_cpu (void) {
+
+    // Return the CPU time used by the service, in microseconds.
+    if (LoadPid <= 0) return 0;
+
+    char path[64];
+    snprintf (path, sizeof(path), "/proc/%d/stat", LoadPid);
+    FILE *file = fopen (path, "r");
+    if (!file) return 0;
+
+    char buffer[1024];
+    int length = fread (buffer, 1, sizeof(buffer)-1, file);
+    fclose (file);
+    if (length <= 0) return 0;
+    buffer[length] = 0;
+
+    // Skip the command name, which may contain spaces: the fields
+    // utime and stime are the 12th and 13th after it.
+    const char *cursor = strrchr (buffer, ')');
+    if (!cursor) return 0;
+    unsigned long long utime, stime;
+    if (sscanf (cursor + 2,
+                "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                &utime, &stime) != 2) return 0;
+    return (utime + stime) * 1000000LL / sysconf (_SC_CLK_TCK);
+}
+
+static void load_record (long long latency) {
+
+    if (LoadLatencyCount >= LoadLatencySize) {
+        LoadLatencySize = LoadLatencySize ? 2 * LoadLatencySize : 65536;
+        LoadLatency = realloc (LoadLatency, LoadLatencySize * sizeof(int));
+        if (!LoadLatency) {
+            fprintf (stderr, "no more memory\n");
+            exit (1);
+        }
+    }
+    LoadLatency[LoadLatencyCount++] = (int)latency;
+}
+
+static void load_close (struct LoadConnection *connection) {
+    if (connection->fd >= 0) close (connection->fd);
+    connection->fd = -1;
+}
+
+static int load_connect (struct LoadConnection *connection) {
+
+    struct sockaddr_in address;
+    memset (&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons (LoadPort);
+    address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    connection->fd = socket (AF_INET, SOCK_STREAM, 0);
+    if (connection->fd < 0) return 0;
+
+    int flag = 1;
+    setsockopt (connection->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    if (connect (connection->fd,
+                 (struct sockaddr *)&address, sizeof(address)) < 0) {
+        load_close (connection);
+        return 0;
+    }
+    fcntl (connection->fd, F_SETFL, O_NONBLOCK);
+    return 1;
+}
+
+static void load_start (struct LoadConnection *connection, const char *uri) {
+
+    char target[256];
+    if (!strcmp (uri, "/relays/set")) {
+        snprintf (target, sizeof(target), "%s?point=%s&state=%s",
+                  uri, LoadPoint, (LoadToggle++ & 1) ? "on" : "off");
+    } else if (!strcmp (uri, "/relays/history")) {
+        struct timeval now;
+        gettimeofday (&now, 0);
+        long long since = (1000LL * now.tv_sec) + (now.tv_usec / 1000) - 1000;
+        snprintf (target, sizeof(target), "%s?since=%lld", uri, since);
+    } else {
+        snprintf (target, sizeof(target), "%s", uri);
+    }
+    connection->length =
+        snprintf (connection->request, sizeof(connection->request),
+                  "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", target);
+    connection->sent = 0;
+    connection->received = 0;
+    connection->start = load_now ();
+}
+
+// Return 1 when the response is complete, 0 if more data is needed,
+// -1 if the connection must be closed.
+//
+static int load_complete (struct LoadConnection *connection) {
+
+    connection->response[connection->received] = 0;
+    const char *end = strstr (connection->response, "\r\n\r\n");
+    if (!end) return 0;
+
+    int length = 0;
+    const char *header = strcasestr (connection->response, "Content-Length:");
+    if (header && header < end) length = atoi (header + 15);
+
+    int total = (end + 4 - connection->response) + length;
+    if (connection->received < total) return 0;
+
+    if (strncmp (connection->response + 9, "200", 3) &&
+        strncmp (connection->response + 9, "304", 3))
+        LoadErrors += 1;
+
+    const char *persist = strcasestr (connection->response, "Connection: close");
+    if (persist && persist < end) return -1;
+    return 1;
+}
+
+static int load_compare (const void *a, const void *b) {
+    return *((const int *)a) - *((const int *)b);
+}
+
+static void load_run (const char *uri) {
+
+    int i;
+    int count = LoadConcurrency;
+    struct pollfd polled[LOAD_CONNECTIONS_MAX];
+
+    LoadLatencyCount = 0;
+    LoadErrors = 0;
+
+    for (i = 0; i < count; ++i) {
+        if (!load_connect (LoadConnections + i)) {
+            fprintf (stderr, "cannot connect to port %d: %s\n",
+                     LoadPort, strerror(errno));
+            exit (1);
+        }
+        load_start (LoadConnections + i, uri);
+    }
+
+    long long cpu = load_cpu ();
+    long long start = load_now ();
+    long long deadline = start + (LoadDuration * 1000000LL);
+
+    while (load_now () < deadline) {
+
+        for (i = 0; i < count; ++i) {
+            struct LoadConnection *connection = LoadConnections + i;
+            polled[i].fd = connection->fd;
+            polled[i].events =
+                (connection->sent < connection->length) ? POLLOUT : POLLIN;
+            polled[i].revents = 0;
+        }
+        if (poll (polled, count, 1000) <= 0) continue;
+
+        for (i = 0; i < count; ++i) {
+            struct LoadConnection *connection = LoadConnections + i;
+            if (!polled[i].revents) continue;
+
+            if (connection->sent < connection->length) {
+                int sent = write (connection->fd,
+                                  connection->request + connection->sent,
+                                  connection->length - connection->sent);
+                if (sent > 0) connection->sent += sent;
+                continue;
+            }
+
+            int room = sizeof(connection->response) - connection->received - 1;
+            int received = read (connection->fd,
+                                 connection->response + connection->received,
+                                 room);
+            int status = -1;
+            if (received > 0) {
+                connection->received += received;
+                status = load_complete (connection);
+                if ((status == 0) && (room <= received)) status = -1;
+            }
+            if (status == 0) continue;
+
+            if (status > 0) {
+                load_record (load_now () - connection->start);
+            } else {
+                // Closed by the server: restart the request on a new
+                // connection, without counting it.
+                if (received > 0) load_record (load_now () - connection->start);
+                else LoadErrors += 1;
+                load_close (connection);
+                if (!load_connect (connection)) {
+                    fprintf (stderr, "cannot reconnect: %s\n", strerror(errno));
+                    exit (1);
+                }
+            }
+            load_start (connection, uri);
+        }
+    }
+    long long elapsed = load_now () - start;
+    cpu = load_cpu () - cpu;
+
+    for (i = 0; i < count; ++i) load_close (LoadConnections + i);
+
+    int p50 = 0;
+    int p99 = 0;
+    if (LoadLatencyCount > 0) {
+        qsort (LoadLatency, LoadLatencyCount, sizeof(int), load_compare);
+        p50 = LoadLatency[LoadLatencyCount / 2];
+        p99 = LoadLatency[(LoadLatencyCount * 99) / 100];
+    }
+
+    printf ("{\"case\":\"http\",\"uri\":\"%s\",\"concurrency\":%d,"
+            "\"requests\":%d,\"errors\":%d,\"rps\":%.1f,"
+            "\"p50_us\":%d,\"p99_us\":%d",
+            uri, count, LoadLatencyCount, LoadErrors,
+            (1000000.0 * LoadLatencyCount) / elapsed, p50, p99);
+    if ((LoadPid > 0) && (LoadLatencyCount > 0))
+        printf (",\"cpu_us\":%.1f", (double)cpu / LoadLatencyCount);
+    printf ("}\n");
+    fflush (stdout);
+}
+
+int main (int argc, const char **argv) {
+
+    static const char *defaults[] = {
+        "/relays/status", "/relays/set", "/relays/history", 0
+    };
+
+    int i;
+    int listed = 0;
+    for (i = 1; i < argc; ++i) {
+        if (!strncmp (argv[i], "-port=", 6)) {
+            LoadPort = atoi (argv[i] + 6);
+        } else if (!strncmp (argv[i], "-concurrency=", 13)) {
+            LoadConcurrency = atoi (argv[i] + 13);
+        } else if (!strncmp (argv[i], "-duration=", 10)) {
+            LoadDuration = atoi (argv[i] + 10);
+        } else if (!strncmp (argv[i], "-pid=", 5)) {
+            LoadPid = atoi (argv[i] + 5);
+        } else if (!strncmp (argv[i], "-point=", 7)) {
+            LoadPoint = argv[i] + 7;
+        } else if (argv[i][0] != '-') {
+            listed = 1;
+        }
+    }
+    if (LoadConcurrency < 1) LoadConcurrency = 1;
+    if (LoadConcurrency > LOAD_CONNECTIONS_MAX)
+        LoadConcurrency = LOAD_CONNECTIONS_MAX;
+    if (LoadDuration < 1) LoadDuration = 1;
+
+    for (i = 0; i < LOAD_CONNECTIONS_MAX; ++i) LoadConnections[i].fd = -1;
+
+    if (listed) {
+        for (i = 1; i < argc; ++i) {
+            if (argv[i][0] != '-') load_run (argv[i]);
+        }
+    } else {
+        for (i = 0; defaults[i]; ++i) load_run (defaults[i]);
+    }
+    return 0;
+}
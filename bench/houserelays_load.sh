@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# Measure the web API of HouseRelays against the GPIO simulator.
+#
+# Usage: houserelays_load.sh [points [concurrency [duration [port]]]]
+#
+# The service is started with a generated configuration of the requested
+# number of points, half outputs and half inputs. The inputs follow a
+# waveform that changes one input every 10 milliseconds.
+
+POINTS=${1:-32}
+CONCURRENCY=${2:-8}
+DURATION=${3:-5}
+PORT=${4:-18090}
+
+WORK=$(mktemp -d /tmp/houserelays_bench.XXXXXX)
+trap 'kill $SERVICE 2>/dev/null; rm -rf $WORK' EXIT
+
+OUTPUTS=$(( (POINTS + 1) / 2 ))
+
+config="{\"relays\":{\"iochip\":0,\"points\":["
+for ((i = 0; i < POINTS; i++)) ; do
+   if [ $i -gt 0 ] ; then config="$config," ; fi
+   if [ $i -lt $OUTPUTS ] ; then mode=output ; else mode=input ; fi
+   config="$config{\"name\":\"point$i\",\"mode\":\"$mode\",\"gpio\":$i,\"on\":1}"
+done
+echo "$config]}}" > $WORK/relays.json
+
+time=0
+for ((i = OUTPUTS; i < POINTS; i++)) ; do
+   echo "$time 0 $i 1" >> $WORK/waveform.txt
+   time=$((time + 10))
+done
+for ((i = OUTPUTS; i < POINTS; i++)) ; do
+   echo "$time 0 $i 0" >> $WORK/waveform.txt
+   time=$((time + 10))
+done
+echo "repeat $time" >> $WORK/waveform.txt
+
+./houserelays -http-service=$PORT -config=$WORK/relays.json \
+              -gpio=simulator -simulator-waveform=$WORK/waveform.txt &
+SERVICE=$!
+
+for ((i = 0; i < 50; i++)) ; do
+   if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null ; then break ; fi
+   sleep 0.1
+done
+
+echo "{\"case\":\"http.setup\",\"points\":$POINTS,\"inputs\":$((POINTS - OUTPUTS))}"
+./bench/houserelays_load -port=$PORT -pid=$SERVICE \
+                         -concurrency=$CONCURRENCY -duration=$DURATION
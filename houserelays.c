@@ -30,7 +30,6 @@
 #include <unistd.h>
 
 #include "echttp_cors.h"
-#include "echttp_json.h"
 #include "echttp_static.h"
 #include "houseportalclient.h"
 #include "housediscover.h"
@@ -39,60 +38,204 @@
 #include "housedepositor.h"
 
 #include "houserelays.h"
+#include "houserelays_writer.h"
 #include "houserelays_gpio.h"
 #include "houserelays_memory.h"
+#include "houserelays_archive.h"
+#include "houserelays_checkpoint.h"
+#include "houserelays_event.h"
+#include "houserelays_summary.h"
+#include "houserelays_sampler.h"
+#include "houserelays_timer.h"
+#include "houserelays_sequence.h"
+#include "houserelays_metrics.h"
 
 static char HostName[256];
-static char JsonBuffer[65537];
+
+// The JSON responses are generated directly as text, in a buffer that
+// grows as needed and is reused from one request to the next.
+static RelaysWriter ResponseWriter;
+
+static const char *relays_export (RelaysWriter *writer) {
+
+    const char *text = houserelays_writer_export (writer);
+    if (!text) {
+        echttp_error (500, "no more memory");
+        return "";
+    }
+    echttp_content_type_json ();
+    return text;
+}
+
+// The status document is cached, and generated again only when the state
+// changed (new "latest" value): its timestamp is the time of the state it
+// reports. The "latest" value is also used as the ETag, so that a client
+// can use If-None-Match instead of the known parameter: the same ETag
+// always comes with the same document.
+//
+// Each gear filter has its own cached document. The least recently
+// used entry is reused when a new filter shows up.
+//
+#define STATUS_CACHE_SIZE 8
+
+struct StatusCache {
+    char         gear[64]; // Empty string: no filter.
+    RelaysWriter writer;
+    const char  *text;
+    int          latest;
+    time_t       used;
+    char         tag[32];
+};
+
+static struct StatusCache StatusCache[STATUS_CACHE_SIZE];
+
+static struct StatusCache *relays_status_cache (const char *gear) {
+
+    int i;
+    int oldest = 0;
+    if (!gear) gear = "";
+
+    for (i = 0; i < STATUS_CACHE_SIZE; ++i) {
+        struct StatusCache *cache = StatusCache + i;
+        if (cache->text && (!strcmp (cache->gear, gear))) return cache;
+        if (cache->used < StatusCache[oldest].used) oldest = i;
+    }
+    struct StatusCache *cache = StatusCache + oldest;
+    snprintf (cache->gear, sizeof(cache->gear), "%s", gear);
+    cache->text = 0;
+    return cache;
+}
+
+static const char *relays_status_render (RelaysWriter *writer,
+                                         const char *gear,
+                                         int latest, time_t now) {
+
+    houserelays_writer_start (writer);
+
+    houserelays_writer_object (writer, 0);
+    houserelays_writer_string (writer, "host", HostName);
+    houserelays_writer_string (writer, "proxy", houseportal_server());
+    houserelays_writer_integer (writer, "timestamp", (long long)now);
+    houserelays_writer_integer (writer, "latest", latest);
+    houserelays_writer_object (writer, "control");
+
+    houserelays_writer_bool (writer, "history", 1);
+
+    houserelays_writer_object (writer, "status");
+    houserelays_gpio_status (writer, gear);
+
+    return houserelays_writer_export (writer);
+}
+
+// A client that provides the "latest" value it received as the "known"
+// parameter gets an empty response if nothing changed since: no JSON is
+// built in that case.
+//
+// A long poll client may also provide a "wait" parameter (in seconds),
+// but the request cannot be parked until the next change: echttp calls
+// the route callback from echttp_loop() once the request is complete, and
+// sends the returned string as the response body when the callback
+// returns. There is no handle on the pending request that could be used
+// to answer later: echttp_transfer() only appends an open file of known
+// size to the current response. The response without change is then
+// empty at once, with a Retry-After header, so that a long poll client
+// waits before polling again instead of looping on the server.
+//
+#define STATUS_WAIT_MAX 60 // Seconds.
 
 static const char *relays_status (const char *method, const char *uri,
                                    const char *data, int length) {
 
-    houserelays_gpio_update ();
-    if (houserelays_gpio_same ()) return "";
+    const char *gear = echttp_parameter_get("gear");
+    if (gear && (!gear[0])) gear = 0; // Same as no filter.
 
-    ParserToken token[1024];
-    char pool[65537];
+    const char *waitpar = echttp_parameter_get("wait");
+    int wait = 0;
+    if (waitpar) {
+        wait = atoi (waitpar);
+        if ((wait < 0) || (wait > STATUS_WAIT_MAX)) {
+            echttp_error (400, "invalid wait");
+            return "";
+        }
+    }
 
-    ParserContext context = echttp_json_start (token, 1024, pool, 65537);
+    houserelays_gpio_update ();
+    if (houserelays_gpio_same ()) {
+        if (wait > 0) echttp_attribute_set ("Retry-After", "1");
+        return "";
+    }
 
-    int root = echttp_json_add_object (context, 0, 0);
-    echttp_json_add_string (context, root, "host", HostName);
-    echttp_json_add_string (context, root, "proxy", houseportal_server());
-    echttp_json_add_integer (context, root, "timestamp", (long long)time(0));
-    echttp_json_add_integer (context, root, "latest", houserelays_gpio_current());
-    int top = echttp_json_add_object (context, root, "control");
+    int latest = houserelays_gpio_current ();
+    time_t now = time(0);
 
-    echttp_json_add_bool (context, top, "history", 1);
+    if (gear && (strlen(gear) >= sizeof(StatusCache[0].gear))) {
+        echttp_error (400, "gear list too long");
+        return "";
+    }
+    struct StatusCache *cache = relays_status_cache (gear);
 
-    int container = echttp_json_add_object (context, top, "status");
-    houserelays_gpio_status (context, container);
+    if ((latest != cache->latest) || !cache->text) {
+        cache->text = relays_status_render (&(cache->writer), gear, latest, now);
+        if (!cache->text) {
+            echttp_error (500, "no more memory");
+            return "";
+        }
+        cache->latest = latest;
+        snprintf (cache->tag, sizeof(cache->tag), "\"%d\"", latest);
+    }
+    cache->used = now;
+    echttp_attribute_set ("ETag", cache->tag);
 
-    const char *error =
-        echttp_json_export (context, JsonBuffer, sizeof(JsonBuffer));
-    if (error) {
-        echttp_error (500, error);
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match && (!strcmp (match, cache->tag))) {
+        echttp_error (304, "Not Modified");
         return "";
     }
     echttp_content_type_json ();
-    return JsonBuffer;
+    return cache->text;
 }
 
 static const char *relays_set (const char *method, const char *uri,
                                 const char *data, int length) {
 
     const char *point = echttp_parameter_get("point");
+    const char *points = echttp_parameter_get("points");
+    const char *scene = echttp_parameter_get("scene");
     const char *statep = echttp_parameter_get("state");
     const char *pulsep = echttp_parameter_get("pulse");
+    const char *pulsemsp = echttp_parameter_get("pulse_ms");
     const char *cause = echttp_parameter_get("cause");
-    int state;
+    int state = 0;
     int pulse;
     int found = 0;
 
-    if (!point) {
+    if ((!point) && (!points) && (!scene)) {
         echttp_error (404, "missing point name");
         return "";
     }
+
+    // The pulse length is handled in milliseconds.
+    long long duration = 0;
+    if (pulsemsp)
+        duration = atoll(pulsemsp);
+    else if (pulsep)
+        duration = atoll(pulsep);
+    if ((!pulsemsp) && (duration <= 0x7fffffff)) duration *= 1000;
+    if ((duration < 0) || (duration > 0x7fffffff)) {
+        echttp_error (400, "invalid pulse value");
+        return "";
+    }
+    pulse = (int)duration;
+
+    if (scene) {
+        // A scene defines its own states.
+        if (houserelays_gpio_scene (scene, pulse, cause) < 0) {
+            echttp_error (404, "invalid scene name");
+            return "";
+        }
+        return relays_status (method, uri, data, length);
+    }
+
     if (!statep) {
         echttp_error (400, "missing state value");
         return "";
@@ -106,18 +249,41 @@ static const char *relays_set (const char *method, const char *uri,
         return "";
     }
 
-    pulse = pulsep ? atoi(pulsep) : 0;
-    if (pulse < 0) {
-        echttp_error (400, "invalid pulse value");
-        return "";
-    }
+    if (points) {
+        // Set all listed points at once. The list is validated first,
+        // so that nothing changes if one point is not known.
+        char buffer[1024];
+        if (strlen (points) >= sizeof(buffer)) {
+            echttp_error (400, "list of points is too long");
+            return "";
+        }
+        strcpy (buffer, points);
+        int count = houserelays_gpio_count();
+        int *list = calloc (count, sizeof(int));
+        int *states = calloc (count, sizeof(int));
+
+        int listed = 0;
+        char *cursor = 0;
+        char *name = strtok_r (buffer, ",", &cursor);
+        while (name) {
+            int i = houserelays_gpio_search (name);
+            if (i < 0) break;
+            if (listed < count) {
+                list[listed] = i;
+                states[listed++] = state;
+            }
+            name = strtok_r (0, ",", &cursor);
+        }
+        if (!name) {
+            houserelays_gpio_set_batch
+                ("group", listed, list, states, pulse, cause);
+            found = 1;
+        }
+        free (list);
+        free (states);
 
-    if (!strcmp (point, "all")) {
-       int count = houserelays_gpio_count();
-       int i;
-       for (i = 0; i < count; ++i) {
-           houserelays_gpio_set (i, state, pulse, cause);
-       }
+    } else if (!strcmp (point, "all")) {
+       houserelays_gpio_set_all (state, pulse, cause);
        found = 1;
     } else {
        int i = houserelays_gpio_search (point);
@@ -140,41 +306,102 @@ static const char *relays_history (const char *method, const char *uri,
     const char *syncpar = echttp_parameter_get("sync");
     const char *sincepar = echttp_parameter_get("since");
     const char *periodpar = echttp_parameter_get("period");
+    const char *dictpar = echttp_parameter_get("dictionary");
+    const char *client = echttp_parameter_get("client");
+    const char *format = echttp_parameter_get("format");
+    const char *frompar = echttp_parameter_get("from");
+    const char *topar = echttp_parameter_get("to");
+    const char *windowpar = echttp_parameter_get("window");
     int sync = 0;
     long long since = 0;
+    int dictionary = 0;
     if (syncpar) sync = atoi(syncpar);
     if (sincepar) since = atoll(sincepar);
+    if (dictpar) dictionary = atoi(dictpar);
+    int packed = 0;
+    if (format) packed = (strcmp (format, "packed") == 0);
 
     int period = 0;
     if (periodpar) period = atoi (periodpar);
-    houserelays_gpio_fast (period);
-
-    ParserToken token[20480];
-    char pool[65537];
-
-    ParserContext context = echttp_json_start (token, 20480, pool, 65537);
 
-    int root = echttp_json_add_object (context, 0, 0);
-    echttp_json_add_string (context, root, "host", HostName);
-    echttp_json_add_integer (context, root, "timestamp", (long long)time(0));
-    int top = echttp_json_add_object (context, root, "control");
+    RelaysWriter *writer = &ResponseWriter;
+    houserelays_writer_start (writer);
+
+    houserelays_writer_object (writer, 0);
+    houserelays_writer_string (writer, "host", HostName);
+    houserelays_writer_integer (writer, "timestamp", (long long)time(0));
+    houserelays_writer_object (writer, "control");
+
+    if (frompar) {
+        // Query the persistent archive instead of the recent history.
+        long long to = topar ? atoll(topar) : 1000LL * time(0);
+        houserelays_writer_object (writer, "archive");
+        houserelays_archive_range (atoll(frompar), to, writer);
+    } else if (windowpar) {
+        // Only the per-window summaries of the recent history.
+        houserelays_writer_object (writer, "summary");
+        houserelays_summary_write (since, atoi(windowpar), writer);
+    } else {
+        // Only the clients that follow the live changes need fast scanning.
+        houserelays_gpio_fast (client, period);
+        houserelays_writer_object (writer, "history");
+        houserelays_memory_history (since, dictionary, packed, writer);
+    }
+    houserelays_writer_end (writer);
 
-    int container = echttp_json_add_object (context, top, "history");
-    houserelays_memory_history (since, context, container);
+    if (houserelays_sampler_active()) {
+        houserelays_writer_object (writer, "sampler");
+        houserelays_sampler_status (writer);
+        houserelays_writer_end (writer);
+    }
 
     if (sync) {
-        container = echttp_json_add_object (context, top, "status");
-        houserelays_gpio_status (context, container);
+        houserelays_writer_object (writer, "status");
+        houserelays_gpio_status (writer, 0);
     }
 
-    const char *error =
-        echttp_json_export (context, JsonBuffer, sizeof(JsonBuffer));
-    if (error) {
-        echttp_error (500, error);
-        return "";
+    return relays_export (writer);
+}
+
+static const char *relays_sequence (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    if (strcmp ("POST", method) == 0) {
+        if ((!data) || (length <= 0)) {
+            echttp_error (400, "missing sequence");
+            return "";
+        }
+        const char *error = houserelays_sequence_load (data);
+        if (error) {
+            echttp_error (400, error);
+            return "";
+        }
+    } else {
+        const char *name = echttp_parameter_get("name");
+        const char *action = echttp_parameter_get("action");
+        if (name && action) {
+            switch (houserelays_sequence_control (name, action)) {
+            case -1:
+                echttp_error (404, "invalid sequence name");
+                return "";
+            case -2:
+                echttp_error (400, "invalid sequence action");
+                return "";
+            }
+        }
     }
-    echttp_content_type_json ();
-    return JsonBuffer;
+
+    RelaysWriter *writer = &ResponseWriter;
+    houserelays_writer_start (writer);
+
+    houserelays_writer_object (writer, 0);
+    houserelays_writer_string (writer, "host", HostName);
+    houserelays_writer_integer (writer, "timestamp", (long long)time(0));
+    houserelays_writer_object (writer, "control");
+    houserelays_writer_object (writer, "sequence");
+    houserelays_sequence_status (writer);
+
+    return relays_export (writer);
 }
 
 static const char *relays_config (const char *method, const char *uri,
@@ -197,6 +424,91 @@ static const char *relays_config (const char *method, const char *uri,
     return "";
 }
 
+static const char *relays_metrics (const char *method, const char *uri,
+                                   const char *data, int length) {
+
+    const char *format = echttp_parameter_get("format");
+
+    if (format && (!strcmp (format, "prometheus"))) {
+        const char *text = houserelays_metrics_prometheus ();
+        if (!text) {
+            echttp_error (500, "no more memory");
+            return "";
+        }
+        echttp_content_type_set ("text/plain; version=0.0.4");
+        return text;
+    }
+
+    RelaysWriter *writer = &ResponseWriter;
+    houserelays_writer_start (writer);
+
+    houserelays_writer_object (writer, 0);
+    houserelays_writer_string (writer, "host", HostName);
+    houserelays_writer_integer (writer, "timestamp", (long long)time(0));
+    houserelays_writer_object (writer, "metrics");
+    houserelays_metrics_json (writer);
+    houserelays_writer_end (writer);
+
+    if (houserelays_sampler_active()) {
+        houserelays_writer_object (writer, "sampler");
+        houserelays_sampler_status (writer);
+        houserelays_writer_end (writer);
+    }
+    return relays_export (writer);
+}
+
+// All the web API requests are timed. The handler is found from the URI
+// because echttp does not pass any context to the route's callback.
+static struct {
+    const char *uri;
+    echttp_callback *call;
+    int metric;
+} RelaysRoutes[] = {
+    {"/relays/status",   relays_status,   -1},
+    {"/relays/set",      relays_set,      -1},
+    {"/relays/history",  relays_history,  -1},
+    {"/relays/sequence", relays_sequence, -1},
+    {"/relays/metrics",  relays_metrics,  -1},
+    {"/relays/config",   relays_config,   -1},
+    {0, 0, -1}
+};
+
+static const char *relays_timed (const char *method, const char *uri,
+                                 const char *data, int length) {
+    int i;
+    for (i = 0; RelaysRoutes[i].uri; ++i) {
+        if (strcmp (RelaysRoutes[i].uri, uri)) continue;
+
+        long long start = houserelays_metrics_clock ();
+        const char *response =
+            RelaysRoutes[i].call (method, uri, data, length);
+        houserelays_metrics_observe
+            (RelaysRoutes[i].metric, houserelays_metrics_clock () - start);
+        return response;
+    }
+    echttp_error (404, "Not found");
+    return "";
+}
+
+static void relays_route (void) {
+    int i;
+    for (i = 0; RelaysRoutes[i].uri; ++i) {
+        RelaysRoutes[i].metric = houserelays_metrics_histogram
+            ("houserelays_request_duration_seconds",
+             "endpoint", RelaysRoutes[i].uri, "Duration of web requests.");
+        echttp_route_uri (RelaysRoutes[i].uri, relays_timed);
+    }
+}
+
+static const char *relays_refresh (void) {
+
+    // The running sequences continue with the new points, found by name.
+    // If the new configuration was rejected, the points did not change.
+    const char *error = houserelays_gpio_refresh ();
+    houserelays_sequence_remap ();
+    return error;
+}
+
 static void relays_background (int fd, int mode) {
 
     time_t now = time(0);
@@ -204,10 +516,12 @@ static void relays_background (int fd, int mode) {
     houseportal_background (now);
     houserelays_gpio_periodic (now);
     housediscover (now);
+    houserelays_event_flush ();
     houselog_background (now);
     houseconfig_background (now);
     housedepositor_periodic (now);
     houserelays_memory_background (now);
+    houserelays_archive_background (now);
 }
 
 static void relays_protect (const char *method, const char *uri) {
@@ -242,8 +556,14 @@ int main (int argc, const char **argv) {
     housedepositor_default (defaultoption);
     housedepositor_initialize (argc, argv);
 
+    houserelays_timer_initialize ();
+    houserelays_memory_initialize (argc, argv);
+    houserelays_archive_initialize (argc, argv);
+    houserelays_checkpoint_initialize (argc, argv);
+    houserelays_event_initialize (argc, argv);
+
     error = houseconfig_initialize
-                ("relays", houserelays_gpio_refresh, argc, argv);
+                ("relays", relays_refresh, argc, argv);
     if (error) {
         houselog_trace
             (HOUSE_FAILURE, "CONFIG", "Cannot load configuration: %s\n", error);
@@ -258,11 +578,7 @@ int main (int argc, const char **argv) {
     echttp_cors_allow_method("GET");
     echttp_protect (0, relays_protect);
 
-    echttp_route_uri ("/relays/status",  relays_status);
-    echttp_route_uri ("/relays/set",     relays_set);
-    echttp_route_uri ("/relays/history", relays_history);
-
-    echttp_route_uri ("/relays/config", relays_config);
+    relays_route ();
 
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&relays_background);
@@ -0,0 +1,417 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_archive.c - A persistent history of the input changes.
+ *
+ * This module keeps the input changes on disk, so that they survive
+ * a restart and can be analyzed long after the fact. This is optional:
+ * the archive is enabled only if the -archive=PATH option is present.
+ *
+ * The archive is a set of fixed size segment files in the PATH directory,
+ * each mapped in memory. Each segment holds its own dictionary of point
+ * names, followed by the change records. Records are written in place,
+ * and read directly from the mapping. A new segment is started every day,
+ * or when the current segment is full. Segments older than the retention
+ * period (option -archive-days=N, default 7 days) are deleted.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_archive_initialize (int argc, const char **argv);
+ *
+ *    Retrieve the archive options and open the most recent segment.
+ *
+ * int houserelays_archive_enabled (void);
+ *
+ *    Return true if the archive is active.
+ *
+ * void houserelays_archive_store (long long timestamp,
+ *                                 const char *name, int state);
+ *
+ *    Record one input change. The timestamp is in milliseconds.
+ *
+ * void houserelays_archive_range (long long from, long long to,
+ *                                 RelaysWriter *writer);
+ *
+ *    Write to the current object the archived changes that occurred after
+ *    from and up to to (milliseconds). The format is similar to the
+ *    recent history. The number of changes returned is limited: if the
+ *    range was not covered completely, "more" is set and "to" indicates
+ *    the time of the last change returned. All the changes that occurred
+ *    at that time are returned, so the next request may start from "to".
+ *
+ * void houserelays_archive_background (time_t now);
+ *
+ *    This function must be called every second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "houserelays_writer.h"
+#include "houserelays_archive.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define ARCHIVE_MAGIC "HRARCH01"
+#define ARCHIVE_NAMES 128
+#define ARCHIVE_NAME_LENGTH 32
+#define ARCHIVE_RECORDS 65536
+#define ARCHIVE_REPLY_MAX 4000
+#define ARCHIVE_SEGMENT_PERIOD 86400 // Seconds.
+
+struct ArchiveRecord {
+    long long timestamp;  // Milliseconds.
+    unsigned int point;   // Bit 31: value, bit 30-0: name index.
+    unsigned int reserved;
+};
+
+struct ArchiveHeader {
+    char magic[8];
+    long long start;      // Seconds, time of creation.
+    long long end;        // Milliseconds, time of the newest record.
+    int count;
+    int names;
+    char name[ARCHIVE_NAMES][ARCHIVE_NAME_LENGTH];
+};
+
+struct ArchiveSegment {
+    struct ArchiveHeader header;
+    struct ArchiveRecord record[ARCHIVE_RECORDS];
+};
+
+static const char *ArchivePath = 0;
+static int ArchiveDays = 7;
+
+static struct ArchiveSegment *ArchiveCurrent = 0;
+static char ArchiveCurrentFile[512];
+
+static time_t ArchiveLastCleanup = 0;
+
+static char ArchiveReplyNames[ARCHIVE_NAMES][ARCHIVE_NAME_LENGTH];
+
+static int houserelays_archive_segment (const struct dirent *entry) {
+    return strncmp (entry->d_name, "relays-", 7) == 0;
+}
+
+static struct ArchiveSegment *houserelays_archive_map (const char *file,
+                                                       int writable) {
+
+    int fd = open (file, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0) return 0;
+
+    // A segment that is too short, e.g. truncated by a crash or a full
+    // disk, would fault when accessed: extend it, or ignore it if read-only.
+    struct stat info;
+    if (fstat (fd, &info) || (info.st_size < sizeof(struct ArchiveSegment))) {
+        if ((!writable) || ftruncate (fd, sizeof(struct ArchiveSegment))) {
+            close (fd);
+            return 0;
+        }
+    }
+    void *map = mmap (0, sizeof(struct ArchiveSegment),
+                      writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                      MAP_SHARED, fd, 0);
+    close (fd); // The mapping remains valid.
+    if (map == MAP_FAILED) return 0;
+
+    struct ArchiveSegment *segment = (struct ArchiveSegment *)map;
+    if (writable && (segment->header.magic[0] == 0)) {
+        memcpy (segment->header.magic, ARCHIVE_MAGIC, 8);
+    }
+    if (memcmp (segment->header.magic, ARCHIVE_MAGIC, 8)) {
+        munmap (map, sizeof(struct ArchiveSegment));
+        return 0;
+    }
+    return segment;
+}
+
+static void houserelays_archive_unmap (struct ArchiveSegment *segment) {
+    if (segment) munmap (segment, sizeof(struct ArchiveSegment));
+}
+
+static void houserelays_archive_new (time_t now) {
+
+    if (ArchiveCurrent) {
+        msync (ArchiveCurrent, sizeof(struct ArchiveSegment), MS_ASYNC);
+        houserelays_archive_unmap (ArchiveCurrent);
+        ArchiveCurrent = 0;
+    }
+    snprintf (ArchiveCurrentFile, sizeof(ArchiveCurrentFile),
+              "%s/relays-%lld.dat", ArchivePath, (long long)now);
+
+    ArchiveCurrent = houserelays_archive_map (ArchiveCurrentFile, 1);
+    if (!ArchiveCurrent) {
+        houselog_trace (HOUSE_FAILURE, "ARCHIVE",
+                        "Cannot create %s\n", ArchiveCurrentFile);
+        return;
+    }
+    ArchiveCurrent->header.start = now;
+    ArchiveCurrent->header.end = 0;
+    ArchiveCurrent->header.names = 0;
+    ArchiveCurrent->header.count = 0;
+    DEBUG ("Created archive segment %s\n", ArchiveCurrentFile);
+}
+
+void houserelays_archive_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-archive=", argv[i], &ArchivePath)) continue;
+        if (echttp_option_match ("-archive-days=", argv[i], &value)) {
+            ArchiveDays = atoi (value);
+            if (ArchiveDays <= 0) ArchiveDays = 1;
+            continue;
+        }
+    }
+    if (!ArchivePath) return;
+
+    // Continue with the most recent segment, if any.
+    struct dirent **files;
+    int count = scandir (ArchivePath, &files,
+                         houserelays_archive_segment, alphasort);
+    if (count < 0) {
+        houselog_trace (HOUSE_FAILURE, "ARCHIVE",
+                        "Cannot access %s\n", ArchivePath);
+        ArchivePath = 0;
+        return;
+    }
+    if (count > 0) {
+        snprintf (ArchiveCurrentFile, sizeof(ArchiveCurrentFile),
+                  "%s/%s", ArchivePath, files[count-1]->d_name);
+        ArchiveCurrent = houserelays_archive_map (ArchiveCurrentFile, 1);
+    }
+    if (ArchiveCurrent) {
+        // Do not continue a damaged segment.
+        struct ArchiveHeader *header = &(ArchiveCurrent->header);
+        if ((header->names < 0) || (header->names > ARCHIVE_NAMES) ||
+            (header->count < 0) || (header->count > ARCHIVE_RECORDS)) {
+            houserelays_archive_unmap (ArchiveCurrent);
+            ArchiveCurrent = 0;
+        }
+    }
+    for (i = 0; i < count; ++i) free (files[i]);
+    free (files);
+
+    if (!ArchiveCurrent) houserelays_archive_new (time(0));
+}
+
+int houserelays_archive_enabled (void) {
+    return ArchivePath != 0;
+}
+
+static int houserelays_archive_name (struct ArchiveHeader *header,
+                                     const char *name) {
+    int i;
+    for (i = 0; i < header->names; ++i) {
+        if (!strncmp (header->name[i], name, ARCHIVE_NAME_LENGTH-1)) return i;
+    }
+    if (header->names >= ARCHIVE_NAMES) return -1;
+
+    i = header->names;
+    snprintf (header->name[i], ARCHIVE_NAME_LENGTH, "%s", name);
+    header->names += 1;
+    return i;
+}
+
+void houserelays_archive_store (long long timestamp,
+                                const char *name, int state) {
+
+    if (!ArchiveCurrent) return;
+
+    if (ArchiveCurrent->header.count >= ARCHIVE_RECORDS) {
+        houserelays_archive_new ((time_t)(timestamp / 1000));
+        if (!ArchiveCurrent) return;
+    }
+    struct ArchiveHeader *header = &(ArchiveCurrent->header);
+    int index = houserelays_archive_name (header, name);
+    if (index < 0) return; // Too many different names in this segment.
+
+    struct ArchiveRecord *record = ArchiveCurrent->record + header->count;
+    record->timestamp = timestamp;
+    record->point = (unsigned int)index | (state?0x80000000u:0);
+
+    // Make the record visible only after it was fully written.
+    header->end = timestamp;
+    header->count += 1;
+}
+
+void houserelays_archive_range (long long from, long long to,
+                                RelaysWriter *writer) {
+
+    int i;
+    int names = 0;
+    int reported = 0;
+    int more = 0;
+    long long previous = from;
+
+    int segmentnames[ARCHIVE_NAMES];
+
+    houserelays_writer_integer (writer, "from", from);
+    houserelays_writer_array (writer, "data");
+
+    struct dirent **files = 0;
+    int count = 0;
+    if (ArchivePath)
+        count = scandir (ArchivePath, &files,
+                         houserelays_archive_segment, alphasort);
+
+    for (i = 0; i < count; ++i) {
+
+        if (more) break;
+
+        char file[512];
+        snprintf (file, sizeof(file), "%s/%s", ArchivePath, files[i]->d_name);
+
+        struct ArchiveSegment *segment;
+        if (ArchiveCurrent && (!strcmp (file, ArchiveCurrentFile)))
+            segment = ArchiveCurrent;
+        else
+            segment = houserelays_archive_map (file, 0);
+        if (!segment) continue;
+
+        struct ArchiveHeader *header = &(segment->header);
+        if ((header->end > from) && (header->start * 1000 <= to)) {
+
+            // The header comes from a file, which might be damaged.
+            int known = header->names;
+            if (known > ARCHIVE_NAMES) known = ARCHIVE_NAMES;
+
+            int j;
+            for (j = 0; j < known; ++j) segmentnames[j] = -1;
+
+            int used = header->count;
+            if (used > ARCHIVE_RECORDS) used = ARCHIVE_RECORDS;
+            for (j = 0; j < used; ++j) {
+                struct ArchiveRecord *record = segment->record + j;
+                if (record->timestamp <= from) continue;
+                if (record->timestamp > to) break;
+                // Only stop between two milliseconds: the next request
+                // starts after the last timestamp returned, and all the
+                // changes from one scan share the same timestamp.
+                if ((reported >= ARCHIVE_REPLY_MAX) &&
+                    (record->timestamp != previous)) {
+                    more = 1;
+                    break;
+                }
+                int index = record->point & 0x7fffffff;
+                if (index >= known) continue; // Damaged?
+
+                // Translate to the reply's own dictionary.
+                if (segmentnames[index] < 0) {
+                    int k;
+                    for (k = 0; k < names; ++k) {
+                        if (!strcmp (ArchiveReplyNames[k],
+                                     header->name[index])) break;
+                    }
+                    if (k >= names) {
+                        if (names >= ARCHIVE_NAMES) continue;
+                        snprintf (ArchiveReplyNames[k], ARCHIVE_NAME_LENGTH,
+                                  "%s", header->name[index]);
+                        names += 1;
+                    }
+                    segmentnames[index] = k;
+                }
+
+                houserelays_writer_array (writer, 0);
+                houserelays_writer_integer
+                    (writer, 0, record->timestamp - previous);
+                houserelays_writer_integer (writer, 0, segmentnames[index]);
+                houserelays_writer_integer
+                    (writer, 0, (record->point & 0x80000000)?1:0);
+                houserelays_writer_end (writer);
+                previous = record->timestamp;
+                reported += 1;
+            }
+        }
+        if (segment != ArchiveCurrent) houserelays_archive_unmap (segment);
+    }
+    houserelays_writer_end (writer);
+    for (i = 0; i < count; ++i) free (files[i]);
+    if (files) free (files);
+
+    if (more) {
+        to = previous;
+        houserelays_writer_bool (writer, "more", 1);
+    }
+    houserelays_writer_integer (writer, "to", to);
+    houserelays_writer_array (writer, "names");
+    for (i = 0; i < names; ++i) {
+        houserelays_writer_string (writer, 0, ArchiveReplyNames[i]);
+    }
+    houserelays_writer_end (writer);
+}
+
+static void houserelays_archive_cleanup (time_t now) {
+
+    time_t limit = now - ((ArchiveDays + 1) * ARCHIVE_SEGMENT_PERIOD);
+
+    struct dirent **files;
+    int count = scandir (ArchivePath, &files,
+                         houserelays_archive_segment, alphasort);
+    if (count < 0) return;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        long long start = atoll (files[i]->d_name + 7);
+        if ((start > 0) && (start < limit)) {
+            char file[512];
+            snprintf (file, sizeof(file),
+                      "%s/%s", ArchivePath, files[i]->d_name);
+            if (strcmp (file, ArchiveCurrentFile)) {
+                DEBUG ("Deleting archive segment %s\n", file);
+                unlink (file);
+            }
+        }
+        free (files[i]);
+    }
+    free (files);
+}
+
+void houserelays_archive_background (time_t now) {
+
+    if (!ArchivePath) return;
+
+    if (ArchiveCurrent) {
+        time_t start = (time_t)(ArchiveCurrent->header.start);
+        if ((start / ARCHIVE_SEGMENT_PERIOD) != (now / ARCHIVE_SEGMENT_PERIOD))
+            houserelays_archive_new (now);
+        else
+            msync (ArchiveCurrent, sizeof(struct ArchiveSegment), MS_ASYNC);
+    } else {
+        houserelays_archive_new (now);
+    }
+
+    if (now >= ArchiveLastCleanup + 3600) {
+        houserelays_archive_cleanup (now);
+        ArchiveLastCleanup = now;
+    }
+}
@@ -0,0 +1,53 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_backend.h - The interface to the GPIO hardware.
+ */
+#define RELAYS_LINE_INPUT  1
+#define RELAYS_LINE_OUTPUT 2
+
+typedef struct {
+    unsigned int offset;
+    int direction; // RELAYS_LINE_INPUT or RELAYS_LINE_OUTPUT.
+    int activelow; // Pull up, open drain and active low.
+    int edges;     // Report edge events (inputs only).
+    int value;     // Initial value (outputs only).
+} RelaysLineConfig;
+
+typedef struct {
+    unsigned int offset;
+    int state;           // The new (logical) value of the line.
+    long long timestamp; // System time, in milliseconds.
+} RelaysEdgeEvent;
+
+typedef struct {
+    const char *name;
+    void *(*open)    (const char *path);
+    void  (*close)   (void *chip);
+    void *(*request) (void *chip, int count, const RelaysLineConfig *lines);
+    void  (*release) (void *request);
+    int   (*get)     (void *request, int count,
+                      const unsigned int *offsets, int *values);
+    int   (*set)     (void *request, int count,
+                      const unsigned int *offsets, const int *values);
+    int   (*fd)      (void *request);
+    int   (*events)  (void *request, RelaysEdgeEvent *events, int max);
+    int   (*reconfigure) (void *request, int count,
+                          const RelaysLineConfig *lines);
+} RelaysBackend;
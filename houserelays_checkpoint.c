@@ -0,0 +1,247 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_checkpoint.c - Keep the commanded outputs across restarts.
+ *
+ * This module saves the commanded state of each output, and the deadline
+ * of its pending pulse if any, to a small state file. When the service
+ * restarts, after a crash or an upgrade, the outputs are requested with
+ * their saved state, so that they are back in the right state within
+ * milliseconds instead of waiting for the client applications to control
+ * them again. This is optional: the checkpoint is enabled only if the
+ * -checkpoint=FILE option is present.
+ *
+ * The file is rewritten as a whole every time the outputs are controlled.
+ * It is a text file with one line per output: the state, the pulse
+ * deadline and the point name. The deadline is in milliseconds since
+ * the epoch (0 if none), so that it remains valid after a restart. The new
+ * content is written to a temporary file, which then replaces the old one
+ * in one rename: the file is always either the old or the new version.
+ * The data is not forced to disk, which would be too slow on a SD card:
+ * a crash of the service is covered, a power failure might not be.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_checkpoint_initialize (int argc, const char **argv);
+ *
+ *    Retrieve the checkpoint option and load the saved outputs.
+ *
+ * int houserelays_checkpoint_enabled (void);
+ *
+ *    Return true if the checkpoint is active.
+ *
+ * int houserelays_checkpoint_restore (const char *name,
+ *                                     int *state, long long *deadline);
+ *
+ *    Retrieve the saved state of the named output. The deadline is
+ *    converted to the clock used for timers (see houserelays_timer.c),
+ *    or 0 if there was no pending pulse. Return 0 if the point was not
+ *    saved.
+ *
+ * void houserelays_checkpoint_start (void);
+ *
+ *    Start a new checkpoint, discarding the saved outputs.
+ *
+ * void houserelays_checkpoint_add (const char *name,
+ *                                  int state, long long deadline);
+ *
+ *    Add one output to the checkpoint. The deadline uses the timers
+ *    clock, 0 if there is no pending pulse.
+ *
+ * void houserelays_checkpoint_commit (void);
+ *
+ *    Write the checkpoint to the state file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "houserelays_timer.h"
+#include "houserelays_checkpoint.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+struct CheckpointOutput {
+    char *name;
+    int state;
+    long long deadline; // Milliseconds since the epoch, 0 if none.
+};
+
+static const char *CheckpointFile = 0;
+static char CheckpointTemporary[512];
+
+static struct CheckpointOutput *CheckpointSaved = 0;
+static int CheckpointSavedCount = 0;
+
+static char *CheckpointBuffer = 0;
+static int CheckpointSize = 0;
+static int CheckpointLength = 0;
+static int CheckpointFailed = 0; // Report a write error only once.
+
+static long long houserelays_checkpoint_clock (void) {
+
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    return (1000LL * now.tv_sec) + now.tv_nsec / 1000000;
+}
+
+static void houserelays_checkpoint_forget (void) {
+
+    int i;
+    for (i = 0; i < CheckpointSavedCount; ++i) free (CheckpointSaved[i].name);
+    if (CheckpointSaved) free (CheckpointSaved);
+    CheckpointSaved = 0;
+    CheckpointSavedCount = 0;
+}
+
+static void houserelays_checkpoint_load (void) {
+
+    FILE *file = fopen (CheckpointFile, "r");
+    if (!file) return; // Nothing was saved yet.
+
+    char line[256];
+    int size = 0;
+    while (fgets (line, sizeof(line), file)) {
+        int state;
+        long long deadline;
+        int start = 0;
+        if (sscanf (line, "%d %lld %n", &state, &deadline, &start) < 2)
+            continue;
+        char *name = line + start;
+        name[strcspn (name, "\r\n")] = 0;
+        if ((!start) || (!name[0])) continue;
+
+        if (CheckpointSavedCount >= size) {
+            size = size ? 2 * size : 32;
+            struct CheckpointOutput *saved =
+                realloc (CheckpointSaved, size * sizeof(*saved));
+            if (!saved) break;
+            CheckpointSaved = saved;
+        }
+        struct CheckpointOutput *output = CheckpointSaved + CheckpointSavedCount;
+        output->name = strdup (name);
+        if (!output->name) break;
+        output->state = state ? 1 : 0;
+        output->deadline = (deadline > 0) ? deadline : 0;
+        CheckpointSavedCount += 1;
+    }
+    fclose (file);
+    DEBUG ("loaded %d outputs from %s\n", CheckpointSavedCount, CheckpointFile);
+}
+
+void houserelays_checkpoint_initialize (int argc, const char **argv) {
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-checkpoint=", argv[i], &CheckpointFile))
+            continue;
+    }
+    if (!CheckpointFile) return;
+
+    snprintf (CheckpointTemporary, sizeof(CheckpointTemporary),
+              "%s.new", CheckpointFile);
+    houserelays_checkpoint_load ();
+}
+
+int houserelays_checkpoint_enabled (void) {
+    return CheckpointFile != 0;
+}
+
+int houserelays_checkpoint_restore (const char *name,
+                                    int *state, long long *deadline) {
+
+    int i;
+    for (i = 0; i < CheckpointSavedCount; ++i) {
+        struct CheckpointOutput *output = CheckpointSaved + i;
+        if (strcmp (output->name, name)) continue;
+        *state = output->state;
+        *deadline = 0;
+        if (output->deadline > 0) {
+            *deadline = output->deadline - houserelays_checkpoint_clock ()
+                            + houserelays_timer_now ();
+            if (*deadline <= 0) *deadline = 1; // Already expired.
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void houserelays_checkpoint_start (void) {
+
+    // From now on the current outputs are the reference.
+    houserelays_checkpoint_forget ();
+    CheckpointLength = 0;
+}
+
+void houserelays_checkpoint_add (const char *name,
+                                 int state, long long deadline) {
+
+    if (!CheckpointFile) return;
+
+    if (deadline > 0)
+        deadline += houserelays_checkpoint_clock () - houserelays_timer_now ();
+
+    int needed = strlen (name) + 48;
+    if (CheckpointLength + needed > CheckpointSize) {
+        int size = CheckpointSize ? CheckpointSize : 4096;
+        while (size < CheckpointLength + needed) size *= 2;
+        char *buffer = realloc (CheckpointBuffer, size);
+        if (!buffer) return;
+        CheckpointBuffer = buffer;
+        CheckpointSize = size;
+    }
+    CheckpointLength +=
+        snprintf (CheckpointBuffer + CheckpointLength,
+                  CheckpointSize - CheckpointLength,
+                  "%d %lld %s\n", state ? 1 : 0, deadline, name);
+}
+
+static int houserelays_checkpoint_write (void) {
+
+    int fd = open (CheckpointTemporary, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) return 0;
+    int written = write (fd, CheckpointBuffer, CheckpointLength);
+    close (fd);
+    if (written != CheckpointLength) return 0;
+    return rename (CheckpointTemporary, CheckpointFile) == 0;
+}
+
+void houserelays_checkpoint_commit (void) {
+
+    if (!CheckpointFile) return;
+
+    if (houserelays_checkpoint_write ()) {
+        CheckpointFailed = 0;
+    } else if (!CheckpointFailed) {
+        houselog_trace (HOUSE_FAILURE, "CHECKPOINT",
+                        "Cannot write %s: %s", CheckpointFile, strerror(errno));
+        CheckpointFailed = 1;
+    }
+}
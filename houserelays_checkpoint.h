@@ -0,0 +1,31 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_checkpoint.h - Keep the commanded outputs across restarts.
+ */
+void houserelays_checkpoint_initialize (int argc, const char **argv);
+int  houserelays_checkpoint_enabled (void);
+
+int  houserelays_checkpoint_restore (const char *name,
+                                     int *state, long long *deadline);
+
+void houserelays_checkpoint_start  (void);
+void houserelays_checkpoint_add    (const char *name,
+                                    int state, long long deadline);
+void houserelays_checkpoint_commit (void);
@@ -0,0 +1,200 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_event.c - Report the GPIO controls outside of the request.
+ *
+ * This module queues the events that report the GPIO controls, so that
+ * formatting and recording the events does not delay the control itself.
+ * The events are kept as raw items in a ring of records allocated once,
+ * and are formatted and submitted to houselog in one batch from the
+ * background processing, i.e. after the request was completed.
+ *
+ * The size of the ring can be changed using the -event-queue=N option.
+ * If the ring is full, the new events are dropped and counted. The number
+ * of events dropped is reported as an event of its own on the next flush.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_event_initialize (int argc, const char **argv);
+ *
+ *    Retrieve the options and allocate the ring.
+ *
+ * void houserelays_event_control (const char *object, const char *action,
+ *                                 const char *list, int kind, int pulse,
+ *                                 const char *cause);
+ *
+ *    Queue one control event. The kind is one of the RELAYS_EVENT_xxx
+ *    values. The list is the optional list of points controlled by a
+ *    batch. The pulse is the pulse duration in milliseconds (pulse kind
+ *    only) and the cause is optional. All strings are copied.
+ *
+ * void houserelays_event_flush (void);
+ *
+ *    Submit all queued events to houselog.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "houserelays_writer.h"
+#include "houserelays_event.h"
+#include "houserelays_metrics.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define EVENT_QUEUE_DEFAULT 256
+
+struct EventRecord {
+    int kind;
+    int pulse; // Milliseconds.
+    char object[64];
+    char action[16];
+    char list[256];
+    char cause[128];
+};
+
+static struct EventRecord *EventQueue = 0;
+static int EventSize = 0;
+static int EventProduced = 0;
+static int EventConsumed = 0;
+static int EventDropped = 0; // Since the last flush.
+
+static int EventMetricQueued = -1;
+static int EventMetricDropped = -1;
+static int EventMetricFlush = -1;
+
+void houserelays_event_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    int size = EVENT_QUEUE_DEFAULT;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-event-queue=", argv[i], &value)) {
+            size = atoi (value);
+            if (size <= 0) size = EVENT_QUEUE_DEFAULT;
+            continue;
+        }
+    }
+    if (EventQueue) free (EventQueue);
+    EventQueue = calloc (size, sizeof(struct EventRecord));
+    EventSize = EventQueue ? size : 0;
+    EventProduced = EventConsumed = 0;
+
+    EventMetricQueued = houserelays_metrics_counter
+        ("houserelays_events_queued_total", "Number of control events queued.");
+    EventMetricDropped = houserelays_metrics_counter
+        ("houserelays_events_dropped_total",
+         "Number of control events dropped because the queue was full.");
+    EventMetricFlush = houserelays_metrics_histogram
+        ("houserelays_event_flush_seconds", 0, 0,
+         "Duration of one submission of the queued events.");
+}
+
+static void houserelays_event_copy (char *to, const char *from, int size) {
+
+    // A simple bounded copy: these strings are not formatted.
+    int length = 0;
+    if (from) {
+        length = strnlen (from, size - 1);
+        memcpy (to, from, length);
+    }
+    to[length] = 0;
+}
+
+void houserelays_event_control (const char *object, const char *action,
+                                const char *list, int kind, int pulse,
+                                const char *cause) {
+
+    if (EventProduced - EventConsumed >= EventSize) {
+        EventDropped += 1;
+        houserelays_metrics_add (EventMetricDropped, 1);
+        return;
+    }
+    struct EventRecord *event = EventQueue + (EventProduced % EventSize);
+    event->kind = kind;
+    event->pulse = pulse;
+    houserelays_event_copy (event->object, object, sizeof(event->object));
+    houserelays_event_copy (event->action, action, sizeof(event->action));
+    houserelays_event_copy (event->list, list, sizeof(event->list));
+    houserelays_event_copy (event->cause, cause, sizeof(event->cause));
+    EventProduced += 1;
+    houserelays_metrics_add (EventMetricQueued, 1);
+}
+
+static void houserelays_event_submit (const struct EventRecord *event) {
+
+    char comment[160];
+    if (event->cause[0])
+        snprintf (comment, sizeof(comment), " (%s)", event->cause);
+    else
+        comment[0] = 0;
+
+    // The list of points, if any, comes first in the event text.
+    const char *list = event->list;
+    const char *separator = list[0] ? " " : "";
+
+    switch (event->kind) {
+    case RELAYS_EVENT_PULSE:
+        if (event->pulse % 1000)
+            houselog_event ("GPIO", event->object, event->action,
+                            "%s%sFOR %d MILLISECONDS%s",
+                            list, separator, event->pulse, comment);
+        else
+            houselog_event ("GPIO", event->object, event->action,
+                            "%s%sFOR %d SECONDS%s",
+                            list, separator, event->pulse / 1000, comment);
+        break;
+    case RELAYS_EVENT_END:
+        houselog_event ("GPIO", event->object, event->action,
+                        "%s%sEND OF PULSE", list, separator);
+        break;
+    case RELAYS_EVENT_FAILED:
+        houselog_event ("GPIO", event->object, event->action,
+                        "CONTROL FAILED");
+        break;
+    default:
+        houselog_event ("GPIO", event->object, event->action,
+                        "%s%sLATCHED%s", list, separator, comment);
+    }
+}
+
+void houserelays_event_flush (void) {
+
+    if (EventProduced == EventConsumed && !EventDropped) return;
+
+    long long start = houserelays_metrics_clock ();
+    DEBUG ("flush %d events\n", EventProduced - EventConsumed);
+    while (EventConsumed != EventProduced) {
+        houserelays_event_submit (EventQueue + (EventConsumed % EventSize));
+        EventConsumed += 1;
+    }
+    EventProduced = EventConsumed = 0;
+
+    if (EventDropped) {
+        houselog_event ("GPIO", "events", "DROPPED", "%d EVENTS", EventDropped);
+        EventDropped = 0;
+    }
+    houserelays_metrics_observe
+        (EventMetricFlush, houserelays_metrics_clock () - start);
+}
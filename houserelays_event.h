@@ -0,0 +1,33 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_event.h - Report the GPIO controls outside of the request.
+ */
+#define RELAYS_EVENT_LATCHED 0
+#define RELAYS_EVENT_PULSE   1
+#define RELAYS_EVENT_END     2
+#define RELAYS_EVENT_FAILED  3
+
+void houserelays_event_initialize (int argc, const char **argv);
+
+void houserelays_event_control (const char *object, const char *action,
+                                const char *list, int kind, int pulse,
+                                const char *cause);
+
+void houserelays_event_flush (void);
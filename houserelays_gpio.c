@@ -29,7 +29,21 @@
  *
  * const char *houserelays_gpio_refresh (void);
  *
- *    Re-evaluate the GPIO setup after the configuration changed.
+ *    Re-evaluate the GPIO setup after the configuration changed. Only the
+ *    lines that changed are reconfigured: the outputs that did not change
+ *    keep their state and pending pulse, and the inputs that did not change
+ *    keep their history. A point is considered the same if it uses the same
+ *    line of the same chip, in the same mode and with the same polarity,
+ *    even if its name or description changed.
+ *
+ *    If the new configuration is not valid, the previous points remain
+ *    in use, with their lines, and the error is returned. The inputs that
+ *    were removed are not part of the history summaries anymore.
+ *
+ *    When the -checkpoint=FILE option is used, the outputs are restored
+ *    when the configuration is first loaded, with the state and pending
+ *    pulse that they had before the service restarted. These are saved
+ *    after each change, see houserelays_checkpoint.c.
  *
  * int houserelays_gpio_search (const char *name);
  *
@@ -39,43 +53,85 @@
  *
  *    Return the number of configured relay points available.
  *
+ * int houserelays_gpio_commanded (int point);
+ *
+ *    Return the last state commanded for this output point, 0 if the
+ *    point is not known.
+ *
  * int houserelays_gpio_set (int point, int state, int pulse, const char *cause);
  *
  *    Set the specified point to the on (1) or off (0) state for the pulse
- *    length specified. The pulse length is in seconds. If pulse is 0,
+ *    length specified. The pulse length is in milliseconds. If pulse is 0,
  *    the relay is maintained until a new state is applied. The cause
  *    parameter, if not null, is used to populate the event.
  *
  *    Return 1 on success, 0 if the point is not known and -1 on error.
  *
+ * int houserelays_gpio_set_batch (const char *name, int count,
+ *                                 const int *points, const int *states,
+ *                                 int pulse, const char *cause);
+ *
+ *    Set multiple points at once, each to its own state, with a single
+ *    GPIO request and a single event. The name is used as the event
+ *    object. Points that are not outputs are ignored. The pulse and cause
+ *    parameters apply to all points, see houserelays_gpio_set().
+ *
+ * int houserelays_gpio_set_all (int state, int pulse, const char *cause);
+ *
+ *    Set all output points to the same state, see above.
+ *
+ * int houserelays_gpio_scene (const char *name, int pulse, const char *cause);
+ *
+ *    Apply the named scene, i.e. a configured list of points and states.
+ *    Return -1 if the scene is not known.
+ *
  * void houserelays_gpio_update (void);
  *
  *    Force an update of all the GPIO status. This can be done periodically
  *    and/or before a request for the current status.
  *
- * void houserelays_gpio_status (ParserContext context, int root);
+ * void houserelays_gpio_status (RelaysWriter *writer, const char *gears);
  *
- *    Populate the context with the list of known points and their values.
+ *    Write the list of known points and their values to the current
+ *    object. If gears is not null, it is a comma separated list of gear
+ *    names and only the points that match one of these gears are listed.
  *
- * void houserelays_gpio_fast (int period);
+ * void houserelays_gpio_fast (const char *client, int period);
  *
- *    Enable fast scanning for a few seconds. The period is in millisecond
- *    and must be in the 10 to 999 range. Otherwise a period of 0 means
- *    keep using the existing sampling period.
+ *    Enable fast scanning for a few seconds on behalf of the specified
+ *    client. The period is in millisecond and must be in the 10 to 999
+ *    range. Otherwise the default sampling period is used. The effective
+ *    sampling period is the smallest period requested by the active
+ *    clients. Changing the sampling period does not erase the history.
  *
  *    This should be called periodically to maintain fast scanning active.
  *    This is typically called when the client asks for the change history.
+ *    A client that stops calling is forgotten after a few seconds, and
+ *    the sampling period is then recomputed for the remaining clients.
+ *    All the clients without an identifier (client is null or empty) are
+ *    handled as one, which keeps the fastest period they requested.
+ *
+ *    When the -capture=edge option is used, the inputs are not scanned:
+ *    the kernel reports timestamped edge events instead, and the history
+ *    is always recorded. The period is then only used as the history step.
  *
- * void houserelays_gpio_changes (long long since,
- *                                ParserContext context, int root);
+ *    When the -capture=thread option is used, the inputs are sampled by
+ *    a dedicated thread at the -period value, and the history is always
+ *    recorded. The period requested by the clients is then ignored.
  *
- *    Populate the context with an history of the input changes that occurred
- *    after the provided millisecond timestamp. Point that have not changed
- *    are ommited. If since is 0, return the complete recent history.
+ *    The GPIO hardware is accessed through libgpiod, unless the
+ *    -gpio=simulator option is used, see houserelays_simulator.c.
  *
- * void houserelays_gpio_periodic (void);
+ * void houserelays_gpio_scan (void);
  *
- *    This function must be called every second. It ends the expired pulses.
+ *    Scan the inputs once, as the fast scan does. This is a test hook
+ *    for the benchmark, see bench/houserelays_bench.c.
+ *
+ * void houserelays_gpio_periodic (time_t now);
+ *
+ *    This function must be called every second. It forgets the fast scan
+ *    clients that went silent. (The pulses end on their own timer, see
+ *    houserelays_timer.c.)
  *
  * int houserelays_gpio_same (void);
  *
@@ -91,20 +147,29 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
-#include <gpiod.h>
 
 #include "echttp.h"
-#include "echttp_hash.h"
-#include "echttp_json.h"
 
 #include "houselog.h"
 #include "housestate.h"
 #include "houseconfig.h"
 
 #include "houserelays.h"
+#include "houserelays_writer.h"
+#include "houserelays_index.h"
 #include "houserelays_gpio.h"
+#include "houserelays_backend.h"
+#include "houserelays_gpiod.h"
+#include "houserelays_simulator.h"
 #include "houserelays_memory.h"
+#include "houserelays_archive.h"
+#include "houserelays_timer.h"
+#include "houserelays_sampler.h"
+#include "houserelays_metrics.h"
+#include "houserelays_checkpoint.h"
+#include "houserelays_event.h"
 
 #define DEBUG if (echttp_isdebug()) printf
 
@@ -118,69 +183,197 @@
 #define HOUSE_GPIO_PERIOD_MIN     10   // Milliseconds.
 #define HOUSE_GPIO_SCAN_TIMEOUT 15   // Seconds.
 
+// Room for inputs added by a configuration change, without erasing
+// the history of the existing inputs.
+#define HOUSE_GPIO_SPARE_INPUTS 16
+
 struct RelayMap {
-    const char *name;
-    const char *gear;
-    const char *desc;
-    unsigned int signature; // Accelerates search.
+    char *name; // The strings are copies, see houserelays_gpio_load().
+    char *gear;
+    char *desc;
     int mode;
     int gpio;
     int on;
+    int chip;   // Index in RelayChips.
     int failed; // Failure already detected, avoid logging the same error.
     int state;
     int commanded;
-    time_t deadline;
+    long long deadline; // Milliseconds, see houserelays_timer_now().
+
+    int debounce;   // Milliseconds, 0: no debounce.
+    int pending;    // The new input state being confirmed.
+    long long since; // When the pending state was first seen, 0 if none.
 
-    int history; // Index of this input point in the history.
+    int history; // Index of this input point in the history, -1 if none.
 };
 
 static struct RelayMap *Relays = 0;
-static int *RelayValues = 0;
 static int RelayCount = 0;
+static int RelayCapacity = 0; // Size of the working arrays below.
+
+static RelaysIndex RelayIndex; // Search points by name.
 
 static int *InputIndex = 0;
-static unsigned int *InputOffset = 0;
 static int InputCount = 0;
 
-static int *OutputIndex = 0;
-static unsigned int *OutputOffset = 0;
-static int OutputCount = 0;
+// Each GPIO chip has its own line request, and the points are read and
+// controlled chip by chip. The inputs are read from the fastest chip
+// first, so that a slow I/O expander (e.g. on I2C) does not delay the
+// sampling of the SoC GPIO lines. Each read has its own timestamp.
+//
+struct RelayChipIo {
+    char path[128];
+    void *chip; // See houserelays_backend.h
+    void *line;
+    int inputs;
+    int *inputindex;
+    unsigned int *inputoffset;
+    int outputs;
+    int *outputindex;
+    unsigned int *outputoffset;
+    RelaysLineConfig *lines; // As requested, see houserelays_backend.h
+    int count;
+    int *values;
+    int *sampled; // Used by the sampling thread only.
+    int *known;   // Used by the sampling thread only.
+    int edgefd;
+    long long latency; // Average read duration, in microseconds.
+};
 
-struct RelayIo {
+static struct RelayChipIo *RelayChips = 0;
+static int *RelayChipOrder = 0; // Fastest chip first.
+static int RelayChipCount = 0;
+
+// Working storage for controlling multiple outputs at once.
+static unsigned int *BatchOffset = 0;
+static int *BatchValue = 0;
+static int *BatchPoint = 0;
+static int *BatchState = 0;
+static int *BatchMark = 0; // Detect duplicates.
+static int BatchSerial = 0;
+
+// Working storage for building a list of points to control.
+static int *GroupPoint = 0;
+static int *GroupState = 0;
+
+// A scene is a named list of output points and states, applied at once.
+struct RelayScene {
+    char *name;
+    int count;
+    int *points;
+    int *states;
+};
+
+static struct RelayScene *RelayScenes = 0;
+static int RelaySceneCount = 0;
+
+// The list of points for each gear, to accelerate filtered queries.
+struct RelayGear {
     const char *name;
     int count;
-    struct gpiod_line_settings *settings;
-    unsigned int *offsets;
+    int *points;
+    int mark; // Detect duplicates in a query.
 };
 
-static struct gpiod_chip *RelayChip = 0;
-static struct gpiod_line_request *RelayLine = 0;
+static struct RelayGear *RelayGears = 0;
+static int RelayGearCount = 0;
+static int RelayGearSerial = 0;
 
 static const char *DebugChip = 0;
 
+static const RelaysBackend *RelayBackend = 0;
+
+static int       RelayDefaultPeriod = HOUSE_GPIO_PERIOD_DEFAULT;
 static int       RelaySamplingPeriod = HOUSE_GPIO_PERIOD_DEFAULT;
-static time_t    RelayFastScanEnabled = 0; // Fastscan is on a timer.
+static int       RelayFastScanEnabled = 0;
+static int       RelayHistoryLive = 0; // The input changes are recorded.
+static int       RelayRestored = 0; // The checkpoint was applied.
+
+// Each client that asks for the history subscribes to the fast scan for
+// a limited time, with its own sampling period.
+//
+#define HOUSE_GPIO_CLIENT_MAX 16
+
+struct RelayClient {
+    char id[32];
+    int period;
+    time_t renewed; // Last time this period was requested.
+    time_t expiry;  // 0: not used.
+};
+
+static struct RelayClient RelayClients[HOUSE_GPIO_CLIENT_MAX];
+
+// Edge capture: the kernel detects and timestamps the input changes, which
+// are read from the line request's file descriptor. No polling is needed.
+//
+#define HOUSE_GPIO_EDGE_BUFFER 64
+
+static int RelayEdgeCapture = 0;
+
+// Thread capture: the inputs are sampled by a dedicated thread, see
+// houserelays_sampler.c. The history is always recorded.
+//
+static int RelaySamplerCapture = 0;
+static RelaysEdgeEvent RelayEdges[HOUSE_GPIO_EDGE_BUFFER];
 
 static int LiveGpioState = -1;
 
+// Performance metrics, see houserelays_metrics.c
+static int RelayMetricScans = -1;
+static int RelayMetricScan = -1;
+static int RelayMetricInterval = -1;
+static int RelayMetricPeriod = -1;
+static int RelayMetricRead = -1;
+static int RelayMetricWrite = -1;
+static long long RelayLastScan = 0;
+
 static void houserelays_gpio_setperiod (int period) {
     if ((period < 1000) && (period >= HOUSE_GPIO_PERIOD_MIN))
-        RelaySamplingPeriod = period;
+        RelaySamplingPeriod = RelayDefaultPeriod = period;
 }
 
 const char *houserelays_gpio_initialize (int argc, const char **argv) {
 
     int i;
     const char *value;
+    const char *backend = "gpiod";
     for (i = 1; i < argc; ++i) {
         if (echttp_option_match ("-chip=", argv[i], &DebugChip)) continue;
+        if (echttp_option_match ("-gpio=", argv[i], &backend)) continue;
         if (echttp_option_match ("-period=", argv[i], &value)) {
             houserelays_gpio_setperiod (atoi (value));
             continue;
         }
+        if (echttp_option_match ("-capture=", argv[i], &value)) {
+            RelayEdgeCapture = (strcmp (value, "edge") == 0);
+            RelaySamplerCapture = (strcmp (value, "thread") == 0);
+            continue;
+        }
     }
     LiveGpioState = housestate_declare ("live");
 
+    if (!strcmp (backend, "simulator")) {
+        RelayBackend = houserelays_simulator_backend ();
+        const char *error = houserelays_simulator_initialize (argc, argv);
+        if (error) return error;
+    } else {
+        RelayBackend = houserelays_gpiod_backend ();
+    }
+
+    RelayMetricScans = houserelays_metrics_counter
+        ("houserelays_scans_total", "Number of input scans.");
+    RelayMetricPeriod = houserelays_metrics_gauge
+        ("houserelays_scan_period_milliseconds", "Requested sampling period.");
+    RelayMetricScan = houserelays_metrics_histogram
+        ("houserelays_scan_duration_seconds", 0, 0, "Duration of one scan.");
+    RelayMetricInterval = houserelays_metrics_histogram
+        ("houserelays_scan_interval_seconds", 0, 0,
+         "Actual time between two scans.");
+    RelayMetricRead = houserelays_metrics_histogram
+        ("houserelays_gpio_read_seconds", 0, 0, "Duration of one GPIO read.");
+    RelayMetricWrite = houserelays_metrics_histogram
+        ("houserelays_gpio_write_seconds", 0, 0, "Duration of one GPIO write.");
+
     if (houseconfig_active()) return houserelays_gpio_refresh ();
     return 0;
 }
@@ -225,59 +418,327 @@ static int houserelays_gpio_store (int point, int state) {
     return 1;
 }
 
+static int houserelays_gpio_read (struct RelayChipIo *chip,
+                                  int count, const unsigned int *offsets) {
+
+    if (!chip->line) return 0;
+
+    long long start = houserelays_metrics_clock ();
+    if (RelayBackend->get (chip->line, count, offsets, chip->values)) {
+        DEBUG ("%s: reading %s failed\n", RelayBackend->name, chip->path);
+        return 0;
+    }
+    // Keep a smoothed average of how long it takes to read this chip.
+    long long duration = houserelays_metrics_clock () - start;
+    chip->latency += (duration - chip->latency) / 8;
+    houserelays_metrics_observe (RelayMetricRead, duration);
+    return 1;
+}
+
+static void houserelays_gpio_order (void) {
+
+    // There are only a few chips, and their order rarely changes:
+    // a simple insertion sort is good enough.
+    int i;
+    for (i = 1; i < RelayChipCount; ++i) {
+        int chip = RelayChipOrder[i];
+        long long latency = RelayChips[chip].latency;
+        int j = i;
+        while ((j > 0) && (RelayChips[RelayChipOrder[j-1]].latency > latency)) {
+            RelayChipOrder[j] = RelayChipOrder[j-1];
+            j -= 1;
+        }
+        RelayChipOrder[j] = chip;
+    }
+}
+
+static int houserelays_gpio_stable (int point, int state, long long timestamp) {
+
+    // A new input state is accepted only once it has been seen for
+    // the whole debounce time. A glitch shorter than that is ignored.
+    struct RelayMap *relay = Relays + point;
+    if (state == relay->state) {
+        relay->since = 0;
+        return 0;
+    }
+    if ((!relay->since) || (relay->pending != state)) {
+        relay->pending = state;
+        relay->since = timestamp;
+    }
+    return (timestamp - relay->since >= relay->debounce);
+}
+
+static int houserelays_gpio_inputs (struct RelayChipIo *chip,
+                                    long long timestamp, int record) {
+
+    int i;
+    int changed = 0;
+    for (i = 0; i < chip->inputs; ++i) {
+        int point = chip->inputindex[i];
+        int state = chip->values[i];
+        if (Relays[point].debounce > 0) {
+            if (!houserelays_gpio_stable (point, state, timestamp)) continue;
+            Relays[point].since = 0;
+        }
+        if (houserelays_gpio_store (point, state)) {
+            if (record)
+                houserelays_memory_store
+                    (timestamp, Relays[point].history, state);
+            houserelays_archive_store (timestamp, Relays[point].name, state);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
 static void houserelays_gpio_scanner (int fd, int mode) {
 
     if (InputCount <= 0) return; // Beter safe than sorry.
 
     int i;
     int changed = 0;
+    long long timestamp = 0;
+    long long start = houserelays_metrics_clock ();
+
+    if (RelayLastScan)
+        houserelays_metrics_observe (RelayMetricInterval, start - RelayLastScan);
+    RelayLastScan = start;
+
+    for (i = 0; i < RelayChipCount; ++i) {
+        struct RelayChipIo *chip = RelayChips + RelayChipOrder[i];
+        if (chip->inputs <= 0) continue;
+
+        timestamp = houserelays_gpio_timestamp ();
+        if (!houserelays_gpio_read (chip, chip->inputs, chip->inputoffset))
+            continue;
+        changed |= houserelays_gpio_inputs (chip, timestamp, 1);
+    }
+    houserelays_gpio_order ();
+
+    houserelays_metrics_add (RelayMetricScans, 1);
+    houserelays_metrics_set (RelayMetricPeriod, RelaySamplingPeriod);
+    houserelays_metrics_observe
+        (RelayMetricScan, houserelays_metrics_clock () - start);
+
+    if (changed) housestate_changed (LiveGpioState);
+    if (timestamp) houserelays_memory_done (timestamp);
+}
+
+void houserelays_gpio_scan (void) {
+    houserelays_gpio_scanner (-1, 0);
+}
+
+static int houserelays_gpio_input (struct RelayChipIo *chip,
+                                   unsigned int offset) {
+
+    int i;
+    for (i = 0; i < chip->inputs; ++i) {
+        if (chip->inputoffset[i] == offset) return chip->inputindex[i];
+    }
+    return -1;
+}
+
+static void houserelays_gpio_settle (int point, long long now) {
+
+    // The input did not change for the whole debounce time: its last
+    // reported state is now confirmed.
+    if ((point < 0) || (point >= RelayCount)) return;
+
+    int state = Relays[point].pending;
     long long timestamp = houserelays_gpio_timestamp ();
+    if (houserelays_gpio_store (point, state)) {
+        houserelays_memory_store (timestamp, Relays[point].history, state);
+        houserelays_archive_store (timestamp, Relays[point].name, state);
+        housestate_changed (LiveGpioState);
+    }
+    houserelays_memory_done (timestamp);
+}
+
+static int houserelays_gpio_change (long long timestamp, int point, int state) {
+
+    if (Relays[point].debounce > 0) {
+        // Wait until the input stops bouncing.
+        Relays[point].pending = state;
+        houserelays_timer_set
+            (houserelays_timer_now() + Relays[point].debounce,
+             houserelays_gpio_settle, point);
+        return 0;
+    }
+    if (houserelays_gpio_store (point, state)) {
+        houserelays_memory_store (timestamp, Relays[point].history, state);
+        houserelays_archive_store (timestamp, Relays[point].name, state);
+        return 1;
+    }
+    return 0;
+}
+
+static void houserelays_gpio_edges (int fd, int mode) {
+
+    int i;
+    struct RelayChipIo *chip = 0;
+    for (i = 0; i < RelayChipCount; ++i) {
+        if (RelayChips[i].edgefd == fd) {
+            chip = RelayChips + i;
+            break;
+        }
+    }
+    if ((!chip) || (!chip->line)) return; // Beter safe than sorry.
 
-    if (gpiod_line_request_get_values_subset
-             (RelayLine, InputCount, InputOffset, RelayValues)) {
-        DEBUG ("gpiod_line_request_get_values_subset(scan) failed\n");
+    int changed = 0;
+    int count = RelayBackend->events
+                    (chip->line, RelayEdges, HOUSE_GPIO_EDGE_BUFFER);
+    if (count < 0) {
+        DEBUG ("%s: reading %s events failed\n",
+               RelayBackend->name, chip->path);
         return;
     }
-    for (i = 0; i < InputCount; ++i) {
-        int point = InputIndex[i];
-        int state = RelayValues[i];
-        if (houserelays_gpio_store (point, state)) {
-            houserelays_memory_store (timestamp, Relays[point].history, state);
-            changed = 1;
+
+    for (i = 0; i < count; ++i) {
+        RelaysEdgeEvent *event = RelayEdges + i;
+        int point = houserelays_gpio_input (chip, event->offset);
+        if (point < 0) continue;
+
+        changed |= houserelays_gpio_change
+                       (event->timestamp, point, event->state);
+    }
+    if (changed) housestate_changed (LiveGpioState);
+    houserelays_memory_done (houserelays_gpio_timestamp ());
+}
+
+static void houserelays_gpio_sample (void) {
+
+    // This runs in the sampling thread: it only touches the input
+    // line requests and the sampling buffers. The changes are handled
+    // later by the main thread, see houserelays_gpio_sampled().
+    int i;
+    long long timestamp = 0;
+    for (i = 0; i < RelayChipCount; ++i) {
+        struct RelayChipIo *chip = RelayChips + RelayChipOrder[i];
+        if ((chip->inputs <= 0) || (!chip->line)) continue;
+
+        timestamp = houserelays_gpio_timestamp ();
+        if (RelayBackend->get
+                (chip->line, chip->inputs, chip->inputoffset, chip->sampled))
+            continue;
+
+        int j;
+        for (j = 0; j < chip->inputs; ++j) {
+            int state = chip->sampled[j];
+            if (state == chip->known[j]) continue;
+            // A change that was dropped is detected again on the next scan.
+            if (houserelays_sampler_push
+                    (timestamp, chip->inputindex[j], state))
+                chip->known[j] = state;
         }
     }
+    if (timestamp) houserelays_sampler_scanned (timestamp);
+}
+
+static void houserelays_gpio_sampled (long long timestamp, int changed) {
+
     if (changed) housestate_changed (LiveGpioState);
     houserelays_memory_done (timestamp);
 }
 
-void houserelays_gpio_fast (int period) {
+static void houserelays_gpio_history (void) {
+
+    // Start a new history, with room for a few more inputs.
+    houserelays_memory_reset (InputCount + HOUSE_GPIO_SPARE_INPUTS,
+                              RelaySamplingPeriod);
+    int i;
+    for (i = 0; i < InputCount; ++i) {
+        int point = InputIndex[i];
+        Relays[point].history =
+            houserelays_memory_add (Relays[point].name, Relays[point].state);
+    }
+    RelayHistoryLive = 1;
+}
+
+static int houserelays_gpio_client (const char *id) {
+
+    int i;
+    int available = -1;
+    for (i = 0; i < HOUSE_GPIO_CLIENT_MAX; ++i) {
+        if (!RelayClients[i].expiry) {
+            if (available < 0) available = i;
+            continue;
+        }
+        if (!strcmp (RelayClients[i].id, id)) return i;
+    }
+    if (available < 0) return -1;
+
+    snprintf (RelayClients[available].id,
+              sizeof(RelayClients[available].id), "%s", id);
+    return available;
+}
+
+static void houserelays_gpio_recompute (void) {
+
+    // The effective sampling period is the fastest requested by any
+    // active client.
+    int i;
+    int period = 0;
+    for (i = 0; i < HOUSE_GPIO_CLIENT_MAX; ++i) {
+        if (!RelayClients[i].expiry) continue;
+        if ((!period) || (RelayClients[i].period < period))
+            period = RelayClients[i].period;
+    }
+    if ((!period) || (period == RelaySamplingPeriod)) return;
+
+    DEBUG ("sampling period changed from %d to %d\n",
+           RelaySamplingPeriod, period);
+    RelaySamplingPeriod = period;
+    if (RelayFastScanEnabled) {
+        echttp_fastscan (houserelays_gpio_scanner, RelaySamplingPeriod);
+        houserelays_memory_rate (RelaySamplingPeriod); // History is kept.
+    }
+}
+
+void houserelays_gpio_fast (const char *client, int period) {
 
     if (InputCount <= 0) return; // Nothing to enable anyway.
 
-    if (period && RelayFastScanEnabled) {
-        // If an explicit sampling period is requested while already
-        // scanning, only accept smaller periods (faster). This is
-        // because there could be multiple clients and we must adjust
-        // for the fastest sampling speed requested.
-        //
-        int old = RelaySamplingPeriod;
-        if (period < old) houserelays_gpio_setperiod (period);
-        period = 0; // We are done with updating the period.
-
-        // If the period has changed, reset the memory storage.
-        if (old != RelaySamplingPeriod) RelayFastScanEnabled = 0;
-    }
-    if (!RelayFastScanEnabled) { // Protection against self reset.
-        if (period) houserelays_gpio_setperiod (period);
+    if (RelayEdgeCapture) {
+        // The history is always recorded in edge capture mode: there is
+        // no scan to speed up. Just mark the end of the covered period.
+        houserelays_memory_done (houserelays_gpio_timestamp ());
+        return;
+    }
+    if (RelaySamplerCapture) {
+        // The sampling thread always runs at the configured period.
+        // Make sure that the history is up to date.
+        houserelays_sampler_drain ();
+        return;
+    }
+
+    int subscription = houserelays_gpio_client (client?client:"");
+    if (subscription < 0) {
+        DEBUG ("too many fast scan clients, ignoring %s\n", client);
+        return;
+    }
+    if ((period >= 1000) || (period < HOUSE_GPIO_PERIOD_MIN))
+        period = RelayDefaultPeriod;
+
+    // The clients that do not identify themselves share one subscription:
+    // the fastest period requested recently wins, so that a slow client
+    // does not slow down a fast one.
+    time_t now = time(0);
+    struct RelayClient *entry = RelayClients + subscription;
+    if ((client && client[0]) || (!entry->expiry) ||
+        (period <= entry->period) ||
+        (entry->renewed + HOUSE_GPIO_SCAN_TIMEOUT < now)) {
+        entry->period = period;
+        entry->renewed = now;
+    }
+    entry->expiry = now + HOUSE_GPIO_SCAN_TIMEOUT;
+
+    houserelays_gpio_recompute ();
+
+    if (!RelayFastScanEnabled) {
         echttp_fastscan (houserelays_gpio_scanner, RelaySamplingPeriod);
-        houserelays_memory_reset (InputCount, RelaySamplingPeriod);
-        int i;
-        for (i = 0; i < InputCount; ++i) {
-            int point = InputIndex[i];
-            Relays[point].history = houserelays_memory_add (Relays[point].name);
-        }
+        houserelays_gpio_history ();
+        RelayFastScanEnabled = 1;
     }
-    RelayFastScanEnabled = time(0); // Keep fast scanning for now.
 }
 
 static void houserelays_gpio_slow (void) {
@@ -285,238 +746,743 @@ static void houserelays_gpio_slow (void) {
     if (RelayFastScanEnabled) {
         echttp_fastscan (0, 0);
         RelayFastScanEnabled = 0;
+        RelayHistoryLive = 0;
+        RelayLastScan = 0;
+    }
+    int i;
+    for (i = 0; i < HOUSE_GPIO_CLIENT_MAX; ++i) RelayClients[i].expiry = 0;
+    RelaySamplingPeriod = RelayDefaultPeriod;
+}
+
+static void houserelays_gpio_expire (int point, long long now) {
+
+    // Each pending pulse has its own timer, but the points that were
+    // pulsed together end together, in one batch: the timers of the other
+    // points are cancelled when they are released.
+    if ((point < 0) || (point >= RelayCount)) return;
+    if (Relays[point].mode != HOUSE_GPIO_MODE_OUTPUT) return;
+
+    long long deadline = Relays[point].deadline;
+    if ((deadline <= 0) || (deadline > now)) return; // Ended, or moved.
+
+    int i;
+    int count = 0;
+    for (i = 0; i < RelayCount; ++i) {
+        if (Relays[i].mode != HOUSE_GPIO_MODE_OUTPUT) continue;
+        if (Relays[i].deadline != deadline) continue;
+        GroupPoint[count] = i;
+        GroupState[count++] = 1 - Relays[i].commanded;
+    }
+    if (count > 1)
+        houserelays_gpio_set_batch
+            ("pulse", count, GroupPoint, GroupState, -1, 0);
+    else
+        houserelays_gpio_set (point, 1 - Relays[point].commanded, -1, 0);
+}
+
+static void houserelays_gpio_pulse (int point, long long deadline) {
+
+    Relays[point].deadline = deadline;
+    if (deadline > 0)
+        houserelays_timer_set (deadline, houserelays_gpio_expire, point);
+    else
+        houserelays_timer_cancel (houserelays_gpio_expire, point);
+}
+
+static void houserelays_gpio_checkpoint (void) {
+
+    if (!houserelays_checkpoint_enabled ()) return;
+
+    int i;
+    houserelays_checkpoint_start ();
+    for (i = 0; i < RelayCount; ++i) {
+        if (Relays[i].mode != HOUSE_GPIO_MODE_OUTPUT) continue;
+        houserelays_checkpoint_add
+            (Relays[i].name, Relays[i].commanded, Relays[i].deadline);
     }
+    houserelays_checkpoint_commit ();
 }
 
-static void houserelay_gpio_setting (struct RelayIo *io,
-                                     int direction, int bias) {
+static void houserelays_gpio_restore (void) {
 
-    io->settings = gpiod_line_settings_new();
-    gpiod_line_settings_set_direction (io->settings, direction);
-    gpiod_line_settings_set_bias (io->settings, bias);
-    gpiod_line_settings_set_active_low
-        (io->settings, (bias == GPIOD_LINE_BIAS_PULL_UP));
-    io->offsets = calloc (RelayCount, sizeof(unsigned int));
+    // Restore the outputs as saved before the service restarted. A pulse
+    // that ended while the service was down is not applied anymore.
+    // The outputs are set when their lines are requested.
+    int i;
+    int restored = 0;
+    long long now = houserelays_timer_now ();
+    for (i = 0; i < RelayCount; ++i) {
+        if (Relays[i].mode != HOUSE_GPIO_MODE_OUTPUT) continue;
+        int state;
+        long long deadline;
+        if (!houserelays_checkpoint_restore
+                 (Relays[i].name, &state, &deadline)) continue;
+        if ((deadline > 0) && (deadline <= now)) {
+            state = 1 - state;
+            deadline = 0;
+        }
+        Relays[i].commanded = Relays[i].state = state;
+        if (deadline > 0) houserelays_gpio_pulse (i, deadline);
+        restored += 1;
+    }
+    if (restored > 0)
+        houselog_event ("GPIO", "outputs", "RESTORED", "%d POINTS", restored);
 }
 
-static int houserelay_gpio_apply (struct RelayIo *io,
-                                  struct gpiod_line_config *line) {
+static int houserelays_gpio_scene_list (struct RelayScene *scene,
+                                        int parent, const char *path,
+                                        int state) {
 
-    if (io->count > 0) {
-        if (gpiod_line_config_add_line_settings
-               (line, io->offsets, io->count, io->settings)) {
+    int array = houseconfig_array (parent, path);
+    if (array < 0) return 0;
+    int count = houseconfig_array_length (array);
+    if (count <= 0) return 0;
+
+    int *list = calloc (count, sizeof(int));
+    count = houseconfig_enumerate (array, list, count);
+    int i;
+    for (i = 0; i < count; ++i) {
+        const char *name = houseconfig_string (list[i], 0);
+        if (!name) continue;
+        int point = houserelays_gpio_search (name);
+        if (point < 0) {
+            houselog_trace (HOUSE_FAILURE, "GPIO", "Scene %s: unknown point %s\n",
+                            scene->name, name);
+            continue;
+        }
+        // A point can be listed only once, which also bounds the list.
+        int j;
+        for (j = 0; j < scene->count; ++j) {
+            if (scene->points[j] == point) break;
+        }
+        if ((j < scene->count) || (scene->count >= RelayCount)) {
             houselog_trace (HOUSE_FAILURE, "GPIO",
-                            "Cannot apply settings for %s\n", io->name);
-            return 0;
+                            "Scene %s: point %s listed more than once\n",
+                            scene->name, name);
+            continue;
         }
+        scene->points[scene->count] = point;
+        scene->states[scene->count] = state;
+        scene->count += 1;
     }
-    return io->count;
+    free (list);
+    return count;
 }
 
-static void houserelay_gpio_cleanup (struct RelayIo *io) {
+static void houserelays_gpio_gears (void) {
+
+    int i;
+    for (i = 0; i < RelayGearCount; ++i) free (RelayGears[i].points);
+    if (RelayGears) free (RelayGears);
+    RelayGears = calloc (RelayCount, sizeof(struct RelayGear));
+    RelayGearCount = 0;
 
-    if (io->settings) gpiod_line_settings_free(io->settings);
-    io->settings = 0; // Stay safe.
-    if (io->offsets) free (io->offsets);
-    io->offsets = 0; // Stay safe.
-    io->count = 0;
+    for (i = 0; i < RelayCount; ++i) {
+        const char *gear = Relays[i].gear;
+        if ((!gear) || (!gear[0])) continue;
+
+        int j;
+        for (j = 0; j < RelayGearCount; ++j) {
+            if (!strcmp (RelayGears[j].name, gear)) break;
+        }
+        if (j >= RelayGearCount) {
+            RelayGears[j].name = gear;
+            RelayGears[j].points = calloc (RelayCount, sizeof(int));
+            RelayGears[j].count = 0;
+            RelayGears[j].mark = 0;
+            RelayGearCount += 1;
+        }
+        RelayGears[j].points[RelayGears[j].count++] = i;
+    }
 }
 
-const char *houserelays_gpio_refresh (void) {
+static void houserelays_gpio_scenes (void) {
 
-    if (RelayLine) {
-       gpiod_line_request_release (RelayLine);
-       RelayLine = 0;
+    int i;
+    for (i = 0; i < RelaySceneCount; ++i) {
+        free (RelayScenes[i].name);
+        free (RelayScenes[i].points);
+        free (RelayScenes[i].states);
     }
+    if (RelayScenes) free (RelayScenes);
+    RelayScenes = 0;
+    RelaySceneCount = 0;
+
+    int scenes = houseconfig_array (0, ".relays.scenes");
+    if (scenes < 0) return; // Scenes are optional.
+
+    int count = houseconfig_array_length (scenes);
+    if (count <= 0) return;
+
+    int *list = calloc (count, sizeof(int));
+    count = houseconfig_enumerate (scenes, list, count);
+    RelayScenes = calloc (count, sizeof(struct RelayScene));
+
+    for (i = 0; i < count; ++i) {
+        int item = houseconfig_object (list[i], 0);
+        if (item <= 0) continue;
+        const char *name = houseconfig_string (item, ".name");
+        if ((!name) || (!name[0])) continue;
+
+        struct RelayScene *scene = RelayScenes + RelaySceneCount;
+        scene->name = strdup (name);
+        scene->count = 0;
+        scene->points = calloc (RelayCount, sizeof(int));
+        scene->states = calloc (RelayCount, sizeof(int));
+        houserelays_gpio_scene_list (scene, item, ".on", 1);
+        houserelays_gpio_scene_list (scene, item, ".off", 0);
+        DEBUG ("found scene %s with %d points\n", name, scene->count);
+        RelaySceneCount += 1;
+    }
+    free (list);
+}
+
+static void houserelays_gpio_release (struct RelayChipIo *chips, int count) {
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        struct RelayChipIo *chip = chips + i;
+        if (chip->edgefd >= 0) echttp_forget (chip->edgefd);
+        if (chip->line) RelayBackend->release (chip->line);
+        if (chip->chip) RelayBackend->close (chip->chip);
+        if (chip->inputindex) free (chip->inputindex);
+        if (chip->inputoffset) free (chip->inputoffset);
+        if (chip->outputindex) free (chip->outputindex);
+        if (chip->outputoffset) free (chip->outputoffset);
+        if (chip->lines) free (chip->lines);
+        if (chip->values) free (chip->values);
+        if (chip->sampled) free (chip->sampled);
+        if (chip->known) free (chip->known);
+    }
+    if (chips) free (chips);
+}
+
+static int houserelays_gpio_chip (const char *path) {
+
+    int i;
+    for (i = 0; i < RelayChipCount; ++i) {
+        if (!strcmp (RelayChips[i].path, path)) return i;
+    }
+    struct RelayChipIo *chip = RelayChips + RelayChipCount;
+    snprintf (chip->path, sizeof(chip->path), "%s", path);
+    chip->edgefd = -1;
+    RelayChipOrder[RelayChipCount] = RelayChipCount;
+    return RelayChipCount++;
+}
+
+static int houserelays_gpio_compare (const struct RelayChipIo *chip,
+                                     const struct RelayChipIo *old) {
+
+    // Return -1 if the lines are not the same, 1 if the same lines are
+    // configured differently, 0 if nothing changed.
+    if (chip->count != old->count) return -1;
+
+    int i;
+    int changed = 0;
+    for (i = 0; i < chip->count; ++i) {
+        const RelaysLineConfig *line = chip->lines + i;
+        int j;
+        for (j = 0; j < old->count; ++j) {
+            if (old->lines[j].offset == line->offset) break;
+        }
+        if (j >= old->count) return -1;
+        const RelaysLineConfig *before = old->lines + j;
+        if ((line->direction != before->direction) ||
+            (line->activelow != before->activelow) ||
+            (line->edges != before->edges)) changed = 1;
+    }
+    return changed;
+}
+
+static int houserelays_gpio_request (int index,
+                                     struct RelayChipIo *previous, int count) {
+
+    struct RelayChipIo *chip = RelayChips + index;
 
     int i;
+    int inputs = 0;
+    int outputs = 0;
     for (i = 0; i < RelayCount; ++i) {
-        Relays[i].name = 0;
-        Relays[i].signature = 0;
+        if (Relays[i].chip != index) continue;
+        if (Relays[i].mode == HOUSE_GPIO_MODE_OUTPUT)
+            outputs += 1;
+        else
+            inputs += 1;
     }
-    if (RelayChip) gpiod_chip_close (RelayChip);
+    chip->inputindex = calloc (inputs+1, sizeof(int));
+    chip->inputoffset = calloc (inputs+1, sizeof(unsigned int));
+    chip->outputindex = calloc (outputs+1, sizeof(int));
+    chip->outputoffset = calloc (outputs+1, sizeof(unsigned int));
+    chip->lines = calloc (inputs+outputs+1, sizeof(RelaysLineConfig));
+    chip->values = calloc ((inputs>outputs?inputs:outputs)+1, sizeof(int));
+    chip->sampled = calloc (inputs+1, sizeof(int));
+    chip->known = calloc (inputs+1, sizeof(int));
+    if ((!chip->inputindex) || (!chip->inputoffset) ||
+        (!chip->outputindex) || (!chip->outputoffset) || (!chip->lines) ||
+        (!chip->values) || (!chip->sampled) || (!chip->known))
+        return 0;
 
-    houserelays_gpio_slow (); // Will scan fast only on demand.
+    // An active low output is an open drain with a pull up, an active
+    // low input has a pull up. The outputs keep their commanded state,
+    // which is inactive for new outputs.
+    for (i = 0; i < RelayCount; ++i) {
+        if (Relays[i].chip != index) continue;
+        int gpio = Relays[i].gpio;
+        RelaysLineConfig *line = chip->lines + chip->count++;
+        line->offset = gpio;
+        line->activelow = !Relays[i].on;
+        if (Relays[i].mode == HOUSE_GPIO_MODE_OUTPUT) {
+            chip->outputoffset[chip->outputs] = gpio;
+            chip->outputindex[chip->outputs++] = i;
+            line->direction = RELAYS_LINE_OUTPUT;
+            line->edges = 0;
+            line->value = Relays[i].commanded;
+        } else {
+            chip->inputoffset[chip->inputs] = gpio;
+            chip->inputindex[chip->inputs++] = i;
+            line->direction = RELAYS_LINE_INPUT;
+            line->edges = RelayEdgeCapture;
+            line->value = 0;
+        }
+    }
 
-    char path[127];
-    if (DebugChip) {
-        snprintf (path, sizeof(path), "/dev/gpiochip%s", DebugChip);
+    // Reuse the chip and its lines from the previous configuration when
+    // possible. A line request cannot change its list of lines: if the
+    // lines changed, the old request must be released first.
+    struct RelayChipIo *old = 0;
+    for (i = 0; i < count; ++i) {
+        if (previous[i].chip && (!strcmp (previous[i].path, chip->path))) {
+            old = previous + i;
+            break;
+        }
+    }
+    if (old) {
+        chip->chip = old->chip;
+        chip->latency = old->latency;
+        old->chip = 0;
+
+        int changed = houserelays_gpio_compare (chip, old);
+        if ((changed >= 0) && old->line) {
+            chip->line = old->line;
+            old->line = 0;
+            if (!changed) return 1;
+            DEBUG ("reconfigure %d lines of %s\n", chip->count, chip->path);
+            if (!RelayBackend->reconfigure
+                    (chip->line, chip->count, chip->lines)) return 1;
+            houselog_trace (HOUSE_FAILURE, "GPIO",
+                            "Cannot reconfigure the lines of %s", chip->path);
+            RelayBackend->release (chip->line);
+            chip->line = 0;
+        }
+        if (old->line) {
+            RelayBackend->release (old->line);
+            old->line = 0;
+        }
     } else {
-        int chip = houseconfig_integer (0, ".relays.iochip");
-        snprintf (path, sizeof(path), "/dev/gpiochip%d", chip);
+        chip->chip = RelayBackend->open (chip->path);
+        if (!chip->chip) {
+            houselog_trace (HOUSE_FAILURE, "GPIO",
+                            "Cannot access %s\n", chip->path);
+            return 0;
+        }
     }
-    RelayChip = gpiod_chip_open(path);
-    if (!RelayChip) return "cannot access GPIO";
 
-    int relays = houseconfig_array (0, ".relays.points");
-    if (relays < 0) return "cannot find points array";
+    if (chip->count > 0) {
+        DEBUG ("request %d lines of %s\n", chip->count, chip->path);
+        chip->line =
+            RelayBackend->request (chip->chip, chip->count, chip->lines);
+        if (!chip->line) {
+            houselog_trace (HOUSE_FAILURE, "GPIO",
+                            "Cannot request the lines of %s", chip->path);
+        }
+    }
+    return 1;
+}
+
+static const char *houserelays_gpio_allocate (void) {
 
-    int oldcount = RelayCount;
-    RelayCount = houseconfig_array_length (relays);
-    if (RelayCount <= 0) return "no point found";
-    DEBUG ("found %d points\n", RelayCount);
+    if (RelayCount <= RelayCapacity) return 0;
+    RelayCapacity = 0; // Until all the arrays have been allocated.
 
-    if (RelayCount > oldcount) {
-        if (Relays) free(Relays);
-        Relays = calloc(RelayCount, sizeof(struct RelayMap));
-        if (!Relays) return "no more memory";
+    if (InputIndex) free(InputIndex);
+    InputIndex = calloc (RelayCount, sizeof(int));
+    if (!InputIndex) return "no more memory";
 
-        if (RelayValues) free(RelayValues);
-        RelayValues = calloc (RelayCount, sizeof(int));
-        if (!RelayValues) return "no more memory";
+    if (BatchOffset) free(BatchOffset);
+    BatchOffset = calloc (RelayCount, sizeof(unsigned int));
+    if (!BatchOffset) return "no more memory";
 
-        if (InputIndex) free(InputIndex);
-        InputIndex = calloc (RelayCount, sizeof(int));
-        if (!InputIndex) return "no more memory";
+    if (BatchValue) free(BatchValue);
+    BatchValue = calloc (RelayCount, sizeof(int));
+    if (!BatchValue) return "no more memory";
 
-        if (InputOffset) free(InputOffset);
-        InputOffset = calloc (RelayCount, sizeof(int));
-        if (!InputOffset) return "no more memory";
+    if (BatchPoint) free(BatchPoint);
+    BatchPoint = calloc (RelayCount, sizeof(int));
+    if (!BatchPoint) return "no more memory";
 
-        if (OutputIndex) free(OutputIndex);
-        OutputIndex = calloc (RelayCount, sizeof(int));
-        if (!OutputIndex) return "no more memory";
+    if (BatchState) free(BatchState);
+    BatchState = calloc (RelayCount, sizeof(int));
+    if (!BatchState) return "no more memory";
 
-        if (OutputOffset) free(OutputOffset);
-        OutputOffset = calloc (RelayCount, sizeof(int));
-        if (!OutputOffset) return "no more memory";
+    if (BatchMark) free(BatchMark);
+    BatchMark = calloc (RelayCount, sizeof(int));
+    if (!BatchMark) return "no more memory";
+
+    if (GroupPoint) free(GroupPoint);
+    GroupPoint = calloc (RelayCount, sizeof(int));
+    if (!GroupPoint) return "no more memory";
+
+    if (GroupState) free(GroupState);
+    GroupState = calloc (RelayCount, sizeof(int));
+    if (!GroupState) return "no more memory";
+
+    RelayCapacity = RelayCount;
+    return 0;
+}
+
+static char *houserelays_gpio_copy (const char *text) {
+    return text ? strdup (text) : 0;
+}
+
+static void houserelays_gpio_forget (struct RelayMap *points, int count) {
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (points[i].name) free (points[i].name);
+        if (points[i].gear) free (points[i].gear);
+        if (points[i].desc) free (points[i].desc);
     }
-    InputCount = 0;
-    OutputCount = 0;
+    if (points) free (points);
+}
+
+static const char *houserelays_gpio_load (void) {
 
+    // The chip defined at the top level is the default for all points.
+    char defaultchip[128];
+    if (DebugChip) {
+        snprintf (defaultchip, sizeof(defaultchip),
+                  "/dev/gpiochip%s", DebugChip);
+    } else {
+        int chip = houseconfig_integer (0, ".relays.iochip");
+        snprintf (defaultchip, sizeof(defaultchip), "/dev/gpiochip%d", chip);
+    }
+
+    int relays = houseconfig_array (0, ".relays.points");
+    if (relays < 0) return "cannot find points array";
+
+    int total = houseconfig_array_length (relays);
+    if (total <= 0) return "no point found";
+    DEBUG ("found %d points\n", total);
+
+    Relays = calloc(total, sizeof(struct RelayMap));
+    if (!Relays) return "no more memory";
+    RelayCount = total;
+
+    const char *error = houserelays_gpio_allocate ();
+    if (error) return error;
+
+    // There cannot be more chips than points.
+    RelayChips = calloc (RelayCount, sizeof(struct RelayChipIo));
+    if (!RelayChips) return "no more memory";
+    RelayChipOrder = calloc (RelayCount, sizeof(int));
+    if (!RelayChipOrder) return "no more memory";
+
+    int i;
     int count = 0;
     int *list = calloc (RelayCount, sizeof(int));
     houseconfig_enumerate (relays, list, RelayCount);
-    for (i = 0; i < RelayCount; ++i) {
+    for (i = 0; i < total; ++i) {
         int point = houseconfig_object (list[i], 0);
         if (point <= 0) continue;
         const char *name = houseconfig_string (point, ".name");
         if ((!name) || (!name[0])) continue;
 
-        Relays[count].name = name;
-        Relays[count].gear = houseconfig_string (point, ".gear");
+        // The configuration strings do not survive the next configuration
+        // change, which may be rejected: keep copies.
+        Relays[count].name = strdup (name);
+        Relays[count].gear =
+            houserelays_gpio_copy (houseconfig_string (point, ".gear"));
         Relays[count].mode =
             houserelays_gpio_to_mode (houseconfig_string (point, ".mode"));
-        Relays[count].desc = houseconfig_string (point, ".description");
+        Relays[count].desc =
+            houserelays_gpio_copy (houseconfig_string (point, ".description"));
         Relays[count].gpio = houseconfig_integer (point, ".gpio");
         Relays[count].on  = houseconfig_integer (point, ".on") & 1;
+        Relays[count].debounce = houseconfig_integer (point, ".debounce");
+        if (Relays[count].debounce < 0) Relays[count].debounce = 0;
+        Relays[count].since = 0;
+        Relays[count].history = -1;
+
+        // The chip item is present if it is a string, or a non-zero
+        // integer: an integer 0 cannot be told apart from a missing item.
+        const char *chipname = houseconfig_string (point, ".chip");
+        int chip = houseconfig_integer (point, ".chip");
+        if (chipname && chipname[0]) {
+            char path[128];
+            if (chipname[0] == '/')
+                snprintf (path, sizeof(path), "%s", chipname);
+            else
+                snprintf (path, sizeof(path), "/dev/gpiochip%d", atoi(chipname));
+            Relays[count].chip = houserelays_gpio_chip (path);
+        } else if (chip > 0) {
+            char path[128];
+            snprintf (path, sizeof(path), "/dev/gpiochip%d", chip);
+            Relays[count].chip = houserelays_gpio_chip (path);
+        } else {
+            Relays[count].chip = houserelays_gpio_chip (defaultchip);
+        }
 
-        Relays[count].signature = echttp_hash_signature (Relays[count].name);
-        Relays[count].state = 0;
-        Relays[count].commanded = 0;
-        Relays[count].deadline = 0;
-        Relays[count].failed = 0;
+        if (Relays[count].mode != HOUSE_GPIO_MODE_OUTPUT)
+            InputIndex[InputCount++] = count;
 
-        DEBUG ("found point %s, gpio %d, on %d %s\n", Relays[count].name, Relays[count].gpio, Relays[count].on, Relays[count].desc);
+        DEBUG ("found point %s, %s gpio %d, on %d %s\n", Relays[count].name, RelayChips[Relays[count].chip].path, Relays[count].gpio, Relays[count].on, Relays[count].desc);
         count += 1;
     }
     free (list);
     if (count != RelayCount) {
         houselog_trace (HOUSE_FAILURE, "GPIO",
                         "Ignoring %d invalid points\n", RelayCount-count);
-        if (RelayCount <= 0) return "no valid point found";
         RelayCount = count; // Adjust the count to include valid entries only.
+        if (RelayCount <= 0) return "no valid point found";
     }
 
-    // Now that the points configuration has been retrieved,
-    // initialize the access to the IO.
-    //
-    struct RelayIo outhigh = {"outputs active high", 0, 0, 0};
-    struct RelayIo outlow = {"outputs active low", 0, 0, 0};
-    struct RelayIo inhigh = {"inputs active high", 0, 0, 0};
-    struct RelayIo inlow = {"inputs active low", 0, 0, 0};
-
-    houserelay_gpio_setting
-        (&outhigh, GPIOD_LINE_DIRECTION_OUTPUT, GPIOD_LINE_BIAS_DISABLED);
-    gpiod_line_settings_set_output_value
-        (outhigh.settings, GPIOD_LINE_VALUE_INACTIVE);
-    gpiod_line_settings_set_drive
-        (outhigh.settings, GPIOD_LINE_DRIVE_PUSH_PULL);
-
-    houserelay_gpio_setting
-        (&outlow, GPIOD_LINE_DIRECTION_OUTPUT, GPIOD_LINE_BIAS_PULL_UP);
-    gpiod_line_settings_set_output_value
-        (outlow.settings, GPIOD_LINE_VALUE_INACTIVE);
-    gpiod_line_settings_set_drive
-        (outlow.settings, GPIOD_LINE_DRIVE_OPEN_DRAIN);
-
-    houserelay_gpio_setting
-        (&inhigh, GPIOD_LINE_DIRECTION_INPUT, GPIOD_LINE_BIAS_DISABLED);
-    gpiod_line_settings_set_edge_detection
-        (inhigh.settings, GPIOD_LINE_EDGE_NONE);
-
-    houserelay_gpio_setting
-        (&inlow, GPIOD_LINE_DIRECTION_INPUT, GPIOD_LINE_BIAS_PULL_UP);
-    gpiod_line_settings_set_edge_detection
-        (inlow.settings, GPIOD_LINE_EDGE_NONE);
+    houserelays_index_reset (&RelayIndex, RelayCount);
+    for (i = 0; i < RelayCount; ++i) {
+        if (houserelays_index_add (&RelayIndex, Relays[i].name, i) >= 0) {
+            houselog_trace (HOUSE_FAILURE, "GPIO",
+                            "Duplicate point name %s\n", Relays[i].name);
+        }
+    }
+    return 0;
+}
+
+static void houserelays_gpio_carry (const struct RelayMap *previous, int count,
+                                    const struct RelayChipIo *chips) {
 
+    // The points that did not change keep their state, commanded state,
+    // pending pulse and history.
+    int i;
     for (i = 0; i < RelayCount; ++i) {
-        int gpio = Relays[i].gpio;
-        if (Relays[i].mode == HOUSE_GPIO_MODE_OUTPUT) {
-            OutputOffset[OutputCount] = gpio;
-            OutputIndex[OutputCount++] = i;
-            if (Relays[i].on) {
-                outhigh.offsets[outhigh.count++] = gpio;
-            } else {
-                outlow.offsets[outlow.count++] = gpio;
-            }
-        } else {
-            InputOffset[InputCount] = gpio;
-            InputIndex[InputCount++] = i;
-            if (Relays[i].on) {
-                inhigh.offsets[inhigh.count++] = gpio;
+        struct RelayMap *relay = Relays + i;
+        const char *path = RelayChips[relay->chip].path;
+        int j;
+        for (j = 0; j < count; ++j) {
+            const struct RelayMap *old = previous + j;
+            if (old->gpio != relay->gpio) continue;
+            if ((old->mode != relay->mode) || (old->on != relay->on)) continue;
+            if (strcmp (chips[old->chip].path, path)) continue;
+
+            relay->state = old->state;
+            relay->commanded = old->commanded;
+            relay->history = old->history;
+            if (old->deadline > 0) houserelays_gpio_pulse (i, old->deadline);
+            break;
+        }
+    }
+}
+
+static void houserelays_gpio_initial (void) {
+
+    // Get the initial state of the inputs. The changes detected for the
+    // inputs that kept their history are recorded.
+    int i;
+    int changed = 0;
+    for (i = 0; i < RelayChipCount; ++i) {
+        struct RelayChipIo *chip = RelayChips + i;
+        if (chip->inputs <= 0) continue;
+        long long timestamp = houserelays_gpio_timestamp ();
+        if (!houserelays_gpio_read (chip, chip->inputs, chip->inputoffset))
+            continue;
+        int j;
+        for (j = 0; j < chip->inputs; ++j) {
+            int point = chip->inputindex[j];
+            int state = chip->values[j];
+            chip->known[j] = state;
+            if (RelayHistoryLive && (Relays[point].history >= 0)) {
+                if (houserelays_gpio_store (point, state)) {
+                    houserelays_memory_store
+                        (timestamp, Relays[point].history, state);
+                    houserelays_archive_store
+                        (timestamp, Relays[point].name, state);
+                    changed = 1;
+                }
             } else {
-                inlow.offsets[inlow.count++] = gpio;
+                Relays[point].state = state;
             }
         }
     }
+    if (changed) housestate_changed (LiveGpioState);
+}
 
-    struct gpiod_line_config *lineconfig = gpiod_line_config_new();
-    count =  houserelay_gpio_apply (&outhigh, lineconfig);
-    count += houserelay_gpio_apply (&outlow,  lineconfig);
-    count += houserelay_gpio_apply (&inhigh,  lineconfig);
-    count += houserelay_gpio_apply (&inlow,   lineconfig);
+static void houserelays_gpio_retire (const struct RelayMap *previous,
+                                     int count) {
+
+    // The inputs that were removed keep their changes in the history,
+    // but they are not part of the summaries anymore.
+    int i;
+    for (i = 0; i < count; ++i) {
+        int history = previous[i].history;
+        if (history < 0) continue;
+        int j;
+        for (j = 0; j < RelayCount; ++j) {
+            if (Relays[j].history == history) break;
+        }
+        if (j >= RelayCount) houserelays_memory_remove (history);
+    }
+}
 
-    struct gpiod_request_config *requestconfig = gpiod_request_config_new();
-    gpiod_request_config_set_consumer (requestconfig, "HouseRelays");
+static void houserelays_gpio_resume (void) {
 
-    if (count > 0) {
-        RelayLine =
-            gpiod_chip_request_lines (RelayChip, requestconfig, lineconfig);
-        if (!RelayLine) {
-            houselog_trace (HOUSE_FAILURE, "GPIO",
-                            "gpiod_chip_request_lines() failed");
+    // The new configuration was rejected: go on with the previous points,
+    // which still own their lines, timers and names.
+    int i;
+    InputCount = 0;
+    for (i = 0; InputIndex && (i < RelayCount); ++i) {
+        if (Relays[i].mode != HOUSE_GPIO_MODE_OUTPUT)
+            InputIndex[InputCount++] = i;
+    }
+    houserelays_index_reset (&RelayIndex, RelayCount);
+    for (i = 0; i < RelayCount; ++i)
+        houserelays_index_add (&RelayIndex, Relays[i].name, i);
+
+    if (RelaySamplerCapture && (InputCount > 0)) {
+        houserelays_sampler_start (RelayDefaultPeriod,
+                                   houserelays_gpio_sample,
+                                   houserelays_gpio_change,
+                                   houserelays_gpio_sampled);
+    }
+}
+
+const char *houserelays_gpio_refresh (void) {
+
+    if (!RelayBackend) return "GPIO not initialized";
+
+    houserelays_sampler_stop ();
+
+    // Keep the previous points and chips until they have been compared
+    // with the new configuration, or if the new configuration is not
+    // valid: the outputs must not change because of a typo.
+    struct RelayMap *previous = Relays;
+    int previouscount = RelayCount;
+    struct RelayChipIo *previouschips = RelayChips;
+    int previouschipcount = RelayChipCount;
+    int *previousorder = RelayChipOrder;
+
+    Relays = 0;
+    RelayCount = 0;
+    RelayChips = 0;
+    RelayChipCount = 0;
+    RelayChipOrder = 0;
+    InputCount = 0;
+
+    const char *error = houserelays_gpio_load ();
+    if (error) {
+        houserelays_gpio_forget (Relays, RelayCount);
+        houserelays_gpio_release (RelayChips, RelayChipCount);
+        if (RelayChipOrder) free (RelayChipOrder);
+        Relays = previous;
+        RelayCount = previouscount;
+        RelayChips = previouschips;
+        RelayChipCount = previouschipcount;
+        RelayChipOrder = previousorder;
+        houserelays_gpio_resume ();
+        return error;
+    }
+
+    int i;
+    for (i = 0; i < previouscount; ++i) {
+        houserelays_timer_cancel (houserelays_gpio_expire, i);
+        houserelays_timer_cancel (houserelays_gpio_settle, i);
+    }
+    for (i = 0; i < previouschipcount; ++i) {
+        if (previouschips[i].edgefd >= 0)
+            echttp_forget (previouschips[i].edgefd);
+        previouschips[i].edgefd = -1;
+    }
+    if (previousorder) free (previousorder);
+
+    houserelays_gpio_carry (previous, previouscount, previouschips);
+    if (RelayHistoryLive) houserelays_gpio_retire (previous, previouscount);
+    houserelays_gpio_forget (previous, previouscount);
+    if (!RelayRestored) {
+        houserelays_gpio_restore ();
+        RelayRestored = 1;
+    }
+
+    // Now that the points configuration has been retrieved, initialize
+    // the access to the IO, one chip at a time. The previous chips and
+    // lines that are still in use are moved to the new configuration.
+    //
+    int available = 0;
+    for (i = 0; i < RelayChipCount; ++i) {
+        available += houserelays_gpio_request
+                         (i, previouschips, previouschipcount);
+    }
+    houserelays_gpio_release (previouschips, previouschipcount);
+
+    houserelays_gpio_initial ();
+
+    if (RelayHistoryLive) {
+        // Keep the history of the inputs that did not change, and add
+        // the new inputs. The inputs that were removed remain in the
+        // dictionary until their changes are out of the history.
+        for (i = 0; i < InputCount; ++i) {
+            int point = InputIndex[i];
+            if (Relays[point].history >= 0) {
+                houserelays_memory_rename
+                    (Relays[point].history, Relays[point].name);
+                continue;
+            }
+            Relays[point].history =
+                houserelays_memory_add (Relays[point].name, Relays[point].state);
+            if (Relays[point].history < 0) break; // No more room.
+        }
+        if (i < InputCount) houserelays_gpio_history ();
+    } else if ((RelayEdgeCapture || RelaySamplerCapture) && (InputCount > 0)) {
+        houserelays_gpio_history (); // The history is always recorded.
+    }
+
+    if (RelayEdgeCapture && (InputCount > 0)) {
+        for (i = 0; i < RelayChipCount; ++i) {
+            struct RelayChipIo *chip = RelayChips + i;
+            if ((!chip->line) || (chip->inputs <= 0)) continue;
+            chip->edgefd = RelayBackend->fd (chip->line);
+            if (chip->edgefd < 0) continue;
+            echttp_listen (chip->edgefd, 1, houserelays_gpio_edges, 0);
         }
     }
 
-    // The list of controls changed: remove all references to the old names
-    // and erase the existing history.
-    houserelays_memory_reset (InputCount, RelaySamplingPeriod);
+    if (RelaySamplerCapture && (InputCount > 0)) {
+        houserelays_sampler_start (RelayDefaultPeriod,
+                                   houserelays_gpio_sample,
+                                   houserelays_gpio_change,
+                                   houserelays_gpio_sampled);
+    }
+
+    houserelays_gpio_gears ();
+    houserelays_gpio_scenes ();
+    houserelays_gpio_checkpoint ();
 
-    houserelay_gpio_cleanup (&outhigh);
-    houserelay_gpio_cleanup (&outlow);
-    houserelay_gpio_cleanup (&inhigh);
-    houserelay_gpio_cleanup (&inlow);
-    gpiod_line_config_free (lineconfig);
-    gpiod_request_config_free (requestconfig);
+    // The names, gears and list of points may have changed.
+    housestate_changed (LiveGpioState);
 
+    if (!available) return "cannot access GPIO";
     return 0;
 }
 
 int houserelays_gpio_search (const char *name) {
-    int i;
-    unsigned int signature = echttp_hash_signature (name);
-    for (i = 0; i < RelayCount; ++i) {
-       if (Relays[i].signature != signature) continue; // Faster than strcmp()
-       if (!strcmp (name, Relays[i].name)) return i;
-    }
-    return -1;
+    return houserelays_index_search (&RelayIndex, name);
 }
 
 int houserelays_gpio_count (void) {
     return RelayCount;
 }
 
+int houserelays_gpio_commanded (int point) {
+    if ((point < 0) || (point >= RelayCount)) return 0;
+    return Relays[point].commanded;
+}
+
 int houserelays_gpio_set (int point, int state, int pulse, const char *cause) {
 
     if (point < 0 || point > RelayCount) return 0;
@@ -530,118 +1496,287 @@ int houserelays_gpio_set (int point, int state, int pulse, const char *cause) {
 
     if (echttp_isdebug()) {
         if (pulse)
-            printf ("set %s to %s at %lld (pulse %ds)\n", Relays[point].name, namedstate, (long long)now, pulse);
+            printf ("set %s to %s at %lld (pulse %dms)\n", Relays[point].name, namedstate, (long long)now, pulse);
         else
             printf ("set %s to %s at %lld\n", Relays[point].name, namedstate, (long long)now);
     }
 
-    enum gpiod_line_value gpiod_state =
-          state?GPIOD_LINE_VALUE_ACTIVE:GPIOD_LINE_VALUE_INACTIVE;
-    DEBUG ("point %s set to libgpiod state %d\n", Relays[point].name, gpiod_state);
-    if (gpiod_line_request_set_value
-             (RelayLine, Relays[point].gpio, gpiod_state)) {
-        DEBUG ("Setting %s to %d failed\n", Relays[point].name, gpiod_state);
-        houselog_event ("GPIO",
-                        Relays[point].name, namedstate, "CONTROL FAILED");
+    int value = state?1:0;
+    unsigned int offset = Relays[point].gpio;
+    void *line = RelayChips[Relays[point].chip].line;
+    long long start = houserelays_metrics_clock ();
+    int failed = (!line) || RelayBackend->set (line, 1, &offset, &value);
+    houserelays_metrics_observe
+        (RelayMetricWrite, houserelays_metrics_clock () - start);
+    if (failed) {
+        DEBUG ("Setting %s to %d failed\n", Relays[point].name, value);
+        houserelays_event_control (Relays[point].name, namedstate, 0,
+                                   RELAYS_EVENT_FAILED, 0, 0);
         return 0;
     }
 
-    char comment[256];
-    if (cause)
-        snprintf (comment, sizeof(comment), " (%s)", cause);
-    else
-        comment[0] = 0;
-
     if (pulse > 0) {
-        Relays[point].deadline = time(0) + pulse;
-        houselog_event ("GPIO", Relays[point].name, namedstate,
-                        "FOR %d SECONDS%s", pulse, comment);
+        houserelays_gpio_pulse (point, houserelays_timer_now() + pulse);
+        houserelays_event_control (Relays[point].name, namedstate, 0,
+                                   RELAYS_EVENT_PULSE, pulse, cause);
     } else if (pulse < 0) {
-        Relays[point].deadline = 0;
-        houselog_event ("GPIO", Relays[point].name, namedstate,
-                        "END OF PULSE");
+        houserelays_gpio_pulse (point, 0);
+        houserelays_event_control (Relays[point].name, namedstate, 0,
+                                   RELAYS_EVENT_END, 0, 0);
     } else {
-        Relays[point].deadline = 0;
-        houselog_event ("GPIO", Relays[point].name, namedstate,
-                        "LATCHED%s", comment);
+        houserelays_gpio_pulse (point, 0);
+        houserelays_event_control (Relays[point].name, namedstate, 0,
+                                   RELAYS_EVENT_LATCHED, 0, cause);
     }
     Relays[point].commanded = state;
+    houserelays_gpio_checkpoint ();
     housestate_changed (LiveGpioState);
     return 1;
 }
 
-void houserelays_gpio_update (void) {
+static int houserelays_gpio_append (char *list, int size, int length,
+                                    const char *text) {
+
+    // A plain copy, cheaper than formatting, truncated if needed.
+    int room = size - 1 - length;
+    int needed = strlen (text);
+    if (needed > room) needed = room;
+    if (needed > 0) {
+        memcpy (list + length, text, needed);
+        length += needed;
+    }
+    list[length] = 0;
+    return length;
+}
+
+int houserelays_gpio_set_batch (const char *name, int count,
+                                const int *points, const int *states,
+                                int pulse, const char *cause) {
 
     int i;
-    int changed = 0;
+    int outputs = 0;
+
+    if (++BatchSerial <= 0) BatchSerial = 1;
+
+    for (i = 0; i < count; ++i) {
+        int point = points[i];
+        if (point < 0 || point >= RelayCount) continue;
+        if (Relays[point].mode != HOUSE_GPIO_MODE_OUTPUT) continue;
+        if (BatchMark[point] == BatchSerial) continue; // Duplicate.
+        BatchMark[point] = BatchSerial;
 
-    if (OutputCount > 0) {
-        // The output points must be read everytime because they are never
-        // scanned at a high rate.
-        if (gpiod_line_request_get_values_subset
-                 (RelayLine, OutputCount, OutputOffset, RelayValues)) {
-           DEBUG ("gpiod_line_request_get_values_subset(update) failed\n");
-           return;
+        BatchPoint[outputs] = point;
+        BatchState[outputs] = states[i]?1:0;
+        outputs += 1;
+    }
+    if (outputs <= 0) return 1; // Nothing to do.
+
+    DEBUG ("set %d points as %s at %lld\n", outputs, name, (long long)time(0));
+
+    // Issue one request per chip. The points on a chip that could not
+    // be controlled are marked as failed and ignored from there on.
+    int failed = 0;
+    int chip;
+    for (chip = 0; chip < RelayChipCount; ++chip) {
+        int lines = 0;
+        for (i = 0; i < outputs; ++i) {
+            int point = BatchPoint[i];
+            if (Relays[point].chip != chip) continue;
+            BatchOffset[lines] = Relays[point].gpio;
+            BatchValue[lines++] = BatchState[i];
         }
-        for (i = 0; i < OutputCount; ++i) {
-            changed |= houserelays_gpio_store(OutputIndex[i], RelayValues[i]);
+        if (lines <= 0) continue;
+
+        void *line = RelayChips[chip].line;
+        long long start = houserelays_metrics_clock ();
+        int error = (!line) ||
+            RelayBackend->set (line, lines, BatchOffset, BatchValue);
+        houserelays_metrics_observe
+            (RelayMetricWrite, houserelays_metrics_clock () - start);
+        if (error) {
+            DEBUG ("Setting %s on %s failed\n", name, RelayChips[chip].path);
+            for (i = 0; i < outputs; ++i) {
+                if (Relays[BatchPoint[i]].chip == chip) BatchState[i] = -1;
+            }
+            failed += lines;
         }
     }
+    if (failed) {
+        houserelays_event_control
+            (name, "SET", 0, RELAYS_EVENT_FAILED, 0, 0);
+    }
+    if (failed >= outputs) return 0;
+
+    // Build one single event for the whole batch.
+    char list[256];
+    int length = 0;
+    int listed = 0;
+    long long deadline = (pulse > 0) ? houserelays_timer_now() + pulse : 0;
+    for (i = 0; i < outputs; ++i) {
+        int point = BatchPoint[i];
+        int state = BatchState[i];
+        if (state < 0) continue; // Failed.
+        Relays[point].commanded = state;
+        houserelays_gpio_pulse (point, deadline);
+
+        if (listed++)
+            length = houserelays_gpio_append (list, sizeof(list), length, ", ");
+        length = houserelays_gpio_append
+                     (list, sizeof(list), length, Relays[point].name);
+        length = houserelays_gpio_append
+                     (list, sizeof(list), length, state?" on":" off");
+    }
+    if (length >= sizeof(list) - 1) strcpy (list + sizeof(list) - 4, "...");
 
-    if (!RelayFastScanEnabled && (InputCount > 0)) {
-       // Must read input points now since there is no high speed scan.
-       if (gpiod_line_request_get_values_subset
-                (RelayLine, InputCount, InputOffset, RelayValues)) {
-          DEBUG ("gpiod_line_request_get_values_subset(update) failed\n");
-          if (changed) housestate_changed (LiveGpioState);
-          return;
-       }
-       for (i = 0; i < InputCount; ++i) {
-          changed |= houserelays_gpio_store (InputIndex[i], RelayValues[i]);
-       }
+    if (pulse > 0) {
+        houserelays_event_control
+            (name, "SET", list, RELAYS_EVENT_PULSE, pulse, cause);
+    } else if (pulse < 0) {
+        houserelays_event_control (name, "SET", list, RELAYS_EVENT_END, 0, 0);
+    } else {
+        houserelays_event_control
+            (name, "SET", list, RELAYS_EVENT_LATCHED, 0, cause);
     }
-    if (changed) housestate_changed (LiveGpioState);
+    houserelays_gpio_checkpoint ();
+    housestate_changed (LiveGpioState);
+    return 1;
 }
 
-void houserelays_gpio_status (ParserContext context, int root) {
+int houserelays_gpio_set_all (int state, int pulse, const char *cause) {
 
     int i;
     for (i = 0; i < RelayCount; ++i) {
-       const char *mode = houserelays_gpio_from_mode(i);
-       const char *status = Relays[i].state?"on":"off";
-       const char *commanded = Relays[i].commanded?"on":"off";
+        GroupPoint[i] = i;
+        GroupState[i] = state;
+    }
+    return houserelays_gpio_set_batch
+               ("all", RelayCount, GroupPoint, GroupState, pulse, cause);
+}
+
+int houserelays_gpio_scene (const char *name, int pulse, const char *cause) {
 
-       int point = echttp_json_add_object (context, root, Relays[i].name);
-       if (mode) echttp_json_add_string (context, point, "mode", mode);
-       echttp_json_add_string (context, point, "state", status);
-       if ((Relays[i].mode == HOUSE_GPIO_MODE_OUTPUT) &&
-           (strcmp (status, commanded)))
-           echttp_json_add_string (context, point, "command", commanded);
-       if (Relays[i].deadline) {
-           echttp_json_add_integer
-               (context, point, "pulse", Relays[i].deadline);
-       }
-       if (Relays[i].gear && (Relays[i].gear[0] != 0))
-           echttp_json_add_string (context, point, "gear", Relays[i].gear);
+    int i;
+    for (i = 0; i < RelaySceneCount; ++i) {
+        struct RelayScene *scene = RelayScenes + i;
+        if (strcmp (scene->name, name)) continue;
+        return houserelays_gpio_set_batch (scene->name, scene->count,
+                                           scene->points, scene->states,
+                                           pulse, cause);
     }
+    return -1;
 }
 
-void houserelays_gpio_periodic (time_t now) {
+void houserelays_gpio_update (void) {
 
     int i;
-    for (i = 0; i < RelayCount; ++i) {
-        if (Relays[i].mode != HOUSE_GPIO_MODE_OUTPUT) continue;
-        if (Relays[i].deadline > 0 && now >= Relays[i].deadline) {
-            houserelays_gpio_set (i, 1 - Relays[i].commanded, -1, 0);
+    int changed = 0;
+    int scan = (!RelayFastScanEnabled) && (!RelayEdgeCapture) &&
+               (!RelaySamplerCapture);
+
+    for (i = 0; i < RelayChipCount; ++i) {
+        struct RelayChipIo *chip = RelayChips + RelayChipOrder[i];
+
+        if (chip->outputs > 0) {
+            // The output points must be read everytime because they are
+            // never scanned at a high rate.
+            if (houserelays_gpio_read
+                    (chip, chip->outputs, chip->outputoffset)) {
+                int j;
+                for (j = 0; j < chip->outputs; ++j) {
+                    changed |= houserelays_gpio_store
+                                   (chip->outputindex[j], chip->values[j]);
+                }
+            }
+        }
+
+        if (scan && (chip->inputs > 0)) {
+            // Must read input points now since there is no high speed scan.
+            long long timestamp = houserelays_gpio_timestamp ();
+            if (houserelays_gpio_read (chip, chip->inputs, chip->inputoffset))
+                changed |= houserelays_gpio_inputs (chip, timestamp, 0);
         }
     }
+    if (changed) housestate_changed (LiveGpioState);
+}
 
-    if (RelayFastScanEnabled) {
-        // If there was no changes request for much more than the stored
-        // history, disable fast scan: there is no active client anymore.
-        time_t deadline = RelayFastScanEnabled + HOUSE_GPIO_SCAN_TIMEOUT;
+static void houserelays_gpio_point (RelaysWriter *writer, int i) {
+
+    const char *mode = houserelays_gpio_from_mode(i);
+    const char *status = Relays[i].state?"on":"off";
+    const char *commanded = Relays[i].commanded?"on":"off";
+
+    houserelays_writer_object (writer, Relays[i].name);
+    if (mode) houserelays_writer_string (writer, "mode", mode);
+    houserelays_writer_string (writer, "state", status);
+    if ((Relays[i].mode == HOUSE_GPIO_MODE_OUTPUT) &&
+        (strcmp (status, commanded)))
+        houserelays_writer_string (writer, "command", commanded);
+    if (Relays[i].deadline) {
+        // Report the end of the pulse as a system time, in seconds.
+        long long remaining = Relays[i].deadline - houserelays_timer_now();
+        if (remaining < 0) remaining = 0;
+        houserelays_writer_integer
+            (writer, "pulse", time(0) + ((remaining + 999) / 1000));
+    }
+    if (Relays[i].gear && (Relays[i].gear[0] != 0))
+        houserelays_writer_string (writer, "gear", Relays[i].gear);
+    houserelays_writer_end (writer);
+}
+
+void houserelays_gpio_status (RelaysWriter *writer, const char *gears) {
+
+    int i;
+
+    if (!gears) {
+        for (i = 0; i < RelayCount; ++i) houserelays_gpio_point (writer, i);
+        return;
+    }
 
-        if (now > deadline) houserelays_gpio_slow ();
+    if (++RelayGearSerial <= 0) RelayGearSerial = 1;
+
+    // Walk the comma separated list of gears without modifying it.
+    const char *cursor = gears;
+    while (*cursor) {
+        const char *end = strchr (cursor, ',');
+        int length = end ? (end - cursor) : strlen(cursor);
+
+        for (i = 0; i < RelayGearCount; ++i) {
+            struct RelayGear *gear = RelayGears + i;
+            if (strncmp (gear->name, cursor, length)) continue;
+            if (gear->name[length]) continue;
+            if (gear->mark == RelayGearSerial) break; // Already listed.
+            gear->mark = RelayGearSerial;
+            int j;
+            for (j = 0; j < gear->count; ++j)
+                houserelays_gpio_point (writer, gear->points[j]);
+            break;
+        }
+        if (!end) break;
+        cursor = end + 1;
+    }
+}
+
+void houserelays_gpio_periodic (time_t now) {
+
+    int i;
+    if (RelayFastScanEnabled) {
+        // Forget the clients that did not ask for changes for much more
+        // than the stored history: the remaining clients decide of the
+        // sampling period. Disable fast scan if there is no client left.
+        int active = 0;
+        for (i = 0; i < HOUSE_GPIO_CLIENT_MAX; ++i) {
+            if (!RelayClients[i].expiry) continue;
+            if (now > RelayClients[i].expiry) {
+                DEBUG ("fast scan client '%s' expired\n", RelayClients[i].id);
+                RelayClients[i].expiry = 0;
+                continue;
+            }
+            active += 1;
+        }
+        if (active)
+            houserelays_gpio_recompute ();
+        else
+            houserelays_gpio_slow ();
     }
 }
 
@@ -26,21 +26,26 @@ const char *houserelays_gpio_refresh (void);
 
 int houserelays_gpio_search (const char *name);
 int houserelays_gpio_count (void);
+int houserelays_gpio_commanded (int point);
 
 const char *houserelays_gpio_failure (int point);
 
 int houserelays_gpio_get (int point);
 int houserelays_gpio_set (int point, int state, int pulse, const char *cause);
+int houserelays_gpio_set_batch (const char *name, int count,
+                                const int *points, const int *states,
+                                int pulse, const char *cause);
+int houserelays_gpio_set_all (int state, int pulse, const char *cause);
+int houserelays_gpio_scene (const char *name, int pulse, const char *cause);
 
 void houserelays_gpio_update (void);
 int  houserelays_gpio_same (void);
 int  houserelays_gpio_current (void);
 
-void houserelays_gpio_fast (int period);
+void houserelays_gpio_fast (const char *client, int period);
+void houserelays_gpio_scan (void);
 
-void houserelays_gpio_status (ParserContext context, int root);
-void houserelays_gpio_changes (long long since,
-                               ParserContext context, int root);
+void houserelays_gpio_status (RelaysWriter *writer, const char *gears);
 
 void houserelays_gpio_periodic (time_t now);
 
@@ -0,0 +1,276 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_gpiod.c - Access the GPIO hardware through libgpiod.
+ *
+ * This module is the default GPIO backend. A backend is a set of functions
+ * that give access to GPIO chips, see RelaysBackend in houserelays_backend.h.
+ * The same interface is implemented by the simulator, see
+ * houserelays_simulator.c. All values are logical values: 1 means active.
+ *
+ * The line requests may be accessed from the sampling thread (see
+ * houserelays_sampler.c) while the main thread controls the outputs, but
+ * a libgpiod object must not be used by two threads at the same time:
+ * each request has its own lock.
+ *
+ * SYNOPSYS:
+ *
+ * const RelaysBackend *houserelays_gpiod_backend (void);
+ *
+ *    Return the libgpiod backend. The operations are:
+ *
+ *    open (path): open the named chip and return a handle, or 0.
+ *
+ *    close (chip): close the chip.
+ *
+ *    request (chip, count, lines): request the listed lines, each with
+ *    its own configuration, and return a request handle, or 0. The outputs
+ *    are initially set to the configured value.
+ *
+ *    release (request): release the lines.
+ *
+ *    get (request, count, offsets, values): read the listed lines.
+ *    set (request, count, offsets, values): control the listed lines.
+ *    Both return 0 on success and -1 on failure.
+ *
+ *    fd (request): return a file descriptor that becomes readable when
+ *    edge events are pending, or -1.
+ *
+ *    events (request, events, max): read the pending edge events. Return
+ *    the number of events, or -1 on failure.
+ *
+ *    reconfigure (request, count, lines): change the configuration of
+ *    the lines of an existing request, without releasing them. The list
+ *    must contain the same lines as the request. Return 0 on success and
+ *    -1 on failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <gpiod.h>
+
+#include "houserelays_backend.h"
+#include "houserelays_gpiod.h"
+
+#define GPIOD_EDGE_BUFFER 64
+
+// The values are passed as is: the libgpiod values are the logical values.
+_Static_assert (sizeof(enum gpiod_line_value) == sizeof(int),
+                "enum gpiod_line_value does not match int");
+
+struct GpiodRequest {
+    struct gpiod_line_request *request;
+    pthread_mutex_t lock;
+};
+
+static struct gpiod_edge_event_buffer *GpiodEdgeBuffer = 0;
+
+static void *houserelays_gpiod_open (const char *path) {
+    return gpiod_chip_open (path);
+}
+
+static void houserelays_gpiod_close (void *chip) {
+    gpiod_chip_close ((struct gpiod_chip *)chip);
+}
+
+static int houserelays_gpiod_line (struct gpiod_line_config *config,
+                                   const RelaysLineConfig *line) {
+
+    struct gpiod_line_settings *settings = gpiod_line_settings_new();
+    if (!settings) return -1;
+
+    enum gpiod_line_bias bias =
+        line->activelow ? GPIOD_LINE_BIAS_PULL_UP : GPIOD_LINE_BIAS_DISABLED;
+
+    gpiod_line_settings_set_bias (settings, bias);
+    gpiod_line_settings_set_active_low (settings, line->activelow);
+
+    if (line->direction == RELAYS_LINE_OUTPUT) {
+        gpiod_line_settings_set_direction
+            (settings, GPIOD_LINE_DIRECTION_OUTPUT);
+        gpiod_line_settings_set_output_value
+            (settings, line->value ? GPIOD_LINE_VALUE_ACTIVE
+                                   : GPIOD_LINE_VALUE_INACTIVE);
+        gpiod_line_settings_set_drive
+            (settings, line->activelow ? GPIOD_LINE_DRIVE_OPEN_DRAIN
+                                       : GPIOD_LINE_DRIVE_PUSH_PULL);
+    } else {
+        gpiod_line_settings_set_direction
+            (settings, GPIOD_LINE_DIRECTION_INPUT);
+        if (line->edges) {
+            gpiod_line_settings_set_edge_detection
+                (settings, GPIOD_LINE_EDGE_BOTH);
+            // Use the wall clock so that the kernel timestamps can be
+            // used as-is in the history.
+            gpiod_line_settings_set_event_clock
+                (settings, GPIOD_LINE_CLOCK_REALTIME);
+        } else {
+            gpiod_line_settings_set_edge_detection
+                (settings, GPIOD_LINE_EDGE_NONE);
+        }
+    }
+    int status = gpiod_line_config_add_line_settings
+                     (config, &(line->offset), 1, settings);
+    gpiod_line_settings_free (settings);
+    return status;
+}
+
+static struct gpiod_line_config *houserelays_gpiod_config
+                                    (int count, const RelaysLineConfig *lines) {
+
+    struct gpiod_line_config *config = gpiod_line_config_new();
+    if (!config) return 0;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (houserelays_gpiod_line (config, lines + i)) {
+            gpiod_line_config_free (config);
+            return 0;
+        }
+    }
+    return config;
+}
+
+static void *houserelays_gpiod_request (void *chip, int count,
+                                        const RelaysLineConfig *lines) {
+
+    struct GpiodRequest *handle = 0;
+    struct gpiod_line_request *request = 0;
+    struct gpiod_line_config *config = houserelays_gpiod_config (count, lines);
+    struct gpiod_request_config *requestconfig = gpiod_request_config_new();
+    if ((!config) || (!requestconfig)) goto cleanup;
+
+    gpiod_request_config_set_consumer (requestconfig, "HouseRelays");
+
+    request = gpiod_chip_request_lines
+                  ((struct gpiod_chip *)chip, requestconfig, config);
+    if (!request) goto cleanup;
+
+    handle = malloc (sizeof(struct GpiodRequest));
+    if (!handle) {
+        gpiod_line_request_release (request);
+        goto cleanup;
+    }
+    handle->request = request;
+    pthread_mutex_init (&(handle->lock), 0);
+
+cleanup:
+    if (config) gpiod_line_config_free (config);
+    if (requestconfig) gpiod_request_config_free (requestconfig);
+    return handle;
+}
+
+static int houserelays_gpiod_reconfigure (void *request, int count,
+                                          const RelaysLineConfig *lines) {
+
+    struct GpiodRequest *handle = (struct GpiodRequest *)request;
+    struct gpiod_line_config *config = houserelays_gpiod_config (count, lines);
+    if (!config) return -1;
+    pthread_mutex_lock (&(handle->lock));
+    int status = gpiod_line_request_reconfigure_lines (handle->request, config);
+    pthread_mutex_unlock (&(handle->lock));
+    gpiod_line_config_free (config);
+    return status;
+}
+
+static void houserelays_gpiod_release (void *request) {
+
+    // The sampling thread is stopped before the lines are released.
+    struct GpiodRequest *handle = (struct GpiodRequest *)request;
+    gpiod_line_request_release (handle->request);
+    pthread_mutex_destroy (&(handle->lock));
+    free (handle);
+}
+
+static int houserelays_gpiod_get (void *request, int count,
+                                  const unsigned int *offsets, int *values) {
+
+    struct GpiodRequest *handle = (struct GpiodRequest *)request;
+    pthread_mutex_lock (&(handle->lock));
+    int status = gpiod_line_request_get_values_subset
+                     (handle->request, count, offsets,
+                      (enum gpiod_line_value *)values);
+    pthread_mutex_unlock (&(handle->lock));
+    return status;
+}
+
+static int houserelays_gpiod_set (void *request, int count,
+                                  const unsigned int *offsets,
+                                  const int *values) {
+
+    struct GpiodRequest *handle = (struct GpiodRequest *)request;
+    pthread_mutex_lock (&(handle->lock));
+    int status = gpiod_line_request_set_values_subset
+                     (handle->request, count, offsets,
+                      (const enum gpiod_line_value *)values);
+    pthread_mutex_unlock (&(handle->lock));
+    return status;
+}
+
+static int houserelays_gpiod_fd (void *request) {
+    struct GpiodRequest *handle = (struct GpiodRequest *)request;
+    return gpiod_line_request_get_fd (handle->request);
+}
+
+static int houserelays_gpiod_events (void *request,
+                                     RelaysEdgeEvent *events, int max) {
+
+    if (!GpiodEdgeBuffer) {
+        GpiodEdgeBuffer = gpiod_edge_event_buffer_new (GPIOD_EDGE_BUFFER);
+        if (!GpiodEdgeBuffer) return -1;
+    }
+    if (max > GPIOD_EDGE_BUFFER) max = GPIOD_EDGE_BUFFER;
+
+    struct GpiodRequest *handle = (struct GpiodRequest *)request;
+    pthread_mutex_lock (&(handle->lock));
+    int count = gpiod_line_request_read_edge_events
+                    (handle->request, GpiodEdgeBuffer, max);
+    pthread_mutex_unlock (&(handle->lock));
+    if (count < 0) return -1;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        struct gpiod_edge_event *event =
+            gpiod_edge_event_buffer_get_event (GpiodEdgeBuffer, i);
+        events[i].offset = gpiod_edge_event_get_line_offset (event);
+        events[i].state = (gpiod_edge_event_get_event_type (event)
+                               == GPIOD_EDGE_EVENT_RISING_EDGE);
+        events[i].timestamp =
+            (long long)(gpiod_edge_event_get_timestamp_ns (event) / 1000000);
+    }
+    return count;
+}
+
+static const RelaysBackend GpiodBackend = {
+    "gpiod",
+    houserelays_gpiod_open,
+    houserelays_gpiod_close,
+    houserelays_gpiod_request,
+    houserelays_gpiod_release,
+    houserelays_gpiod_get,
+    houserelays_gpiod_set,
+    houserelays_gpiod_fd,
+    houserelays_gpiod_events,
+    houserelays_gpiod_reconfigure
+};
+
+const RelaysBackend *houserelays_gpiod_backend (void) {
+    return &GpiodBackend;
+}
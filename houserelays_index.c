@@ -0,0 +1,119 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_index.c - A hash table of names.
+ *
+ * This module associates names with integer values (typically an index
+ * in a table), for a search time that does not depend on the number of
+ * names. This is an open addressing hash table with linear probing, sized
+ * to be at most half full. Names cannot be removed: the table is rebuilt
+ * from scratch when the list of names changes.
+ *
+ * The lifetime of the names is controlled by the caller: they must last
+ * at least until the next reset.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_index_reset (RelaysIndex *index, int count);
+ *
+ *    Empty the table, and make room for up to count names.
+ *
+ * int houserelays_index_add (RelaysIndex *index, const char *name, int value);
+ *
+ *    Associate the name with the value. Return the value previously
+ *    associated with the same name, or -1 if this is a new name.
+ *    (The previous value is kept in that case.)
+ *
+ * int houserelays_index_search (const RelaysIndex *index, const char *name);
+ *
+ *    Return the value associated with the name, or -1 if not found.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "houserelays_index.h"
+
+struct RelaysIndexSlot {
+    const char *name; // 0: empty slot.
+    unsigned int signature;
+    int value;
+};
+
+static unsigned int houserelays_index_signature (const char *name) {
+
+    // FNV-1a.
+    unsigned int signature = 2166136261u;
+    while (*name) {
+        signature ^= (unsigned char)(*(name++));
+        signature *= 16777619u;
+    }
+    return signature;
+}
+
+void houserelays_index_reset (RelaysIndex *index, int count) {
+
+    int size = 16;
+    while (size < 2 * count) size *= 2;
+
+    if (size > index->size) {
+        if (index->slots) free (index->slots);
+        index->slots = calloc (size, sizeof(struct RelaysIndexSlot));
+        index->size = index->slots ? size : 0;
+    } else if (index->slots) {
+        memset (index->slots, 0, index->size * sizeof(struct RelaysIndexSlot));
+    }
+}
+
+int houserelays_index_add (RelaysIndex *index, const char *name, int value) {
+
+    if (index->size <= 0) return -1;
+
+    unsigned int signature = houserelays_index_signature (name);
+    unsigned int mask = index->size - 1;
+    unsigned int i = signature & mask;
+
+    for (;; i = (i + 1) & mask) {
+        struct RelaysIndexSlot *slot = index->slots + i;
+        if (!slot->name) {
+            slot->name = name;
+            slot->signature = signature;
+            slot->value = value;
+            return -1;
+        }
+        if ((slot->signature == signature) && (!strcmp (slot->name, name)))
+            return slot->value;
+    }
+}
+
+int houserelays_index_search (const RelaysIndex *index, const char *name) {
+
+    if (index->size <= 0) return -1;
+
+    unsigned int signature = houserelays_index_signature (name);
+    unsigned int mask = index->size - 1;
+    unsigned int i = signature & mask;
+
+    for (;; i = (i + 1) & mask) {
+        const struct RelaysIndexSlot *slot = index->slots + i;
+        if (!slot->name) return -1;
+        if ((slot->signature == signature) && (!strcmp (slot->name, name)))
+            return slot->value;
+    }
+}
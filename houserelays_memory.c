@@ -28,18 +28,46 @@
  * The buffer is full when the next cursor refers to the entry before
  * the oldest: the buffer can contain up to one event less than its size.
  *
+ * Each event records the delay since the previous event. In order to find
+ * a position in time without walking the whole buffer, the absolute time
+ * of every MEMORY_CHECKPOINT event is recorded in a separate table, which
+ * can be searched using a binary search.
+ *
  * SYNOPSYS:
  *
+ * void houserelays_memory_initialize (int argc, const char **argv);
+ *
+ *    Set the history capacity from the command line options:
+ *    -history-depth=N sets the maximum number of events stored (default:
+ *    1024, minimum 128), -history-retention=N sets the maximum age of the
+ *    events stored, in seconds (default: no limit).
+ *
  * void houserelays_memory_reset (int count, int rate);
  *
  *    Reset the whole storage. Count represents the (maximum) number of
  *    points to handle. Rate represents the sampling rate.
  *
- * int houserelays_memory_add (const char *name);
+ * void houserelays_memory_rate (int rate);
+ *
+ *    Change the sampling rate without erasing the recorded history.
+ *
+ * int houserelays_memory_add (const char *name, int state);
  *
  *    Add one more input point to add to the memory dictionary. This returns
- *    the index assigned to the input point. The lifetime of the name is
- *    controlled by the caller: it must last at least until the next reset.
+ *    the index assigned to the input point, or -1 if the dictionary is full.
+ *    The name is copied. The current state of the point is the starting
+ *    point of its summary, see houserelays_summary.c.
+ *
+ * void houserelays_memory_rename (int index, const char *name);
+ *
+ *    Change the name of an input point without erasing its history. This
+ *    is used when the configuration changed. The name is copied.
+ *
+ * void houserelays_memory_remove (int index);
+ *
+ *    Stop accounting for an input point that was removed from the
+ *    configuration. Its changes remain in the history until they are
+ *    evicted, but its summaries are not reported anymore.
  *
  * void houserelays_memory_store (long long timestamp, int index, int state);
  *
@@ -50,12 +78,20 @@
  *    This must be called at the end of a scan, even if no change was detected,
  *    to set the end of the period that the current changes cover.
  *
- * void houserelays_memory_history (long long since,
- *                                  ParserContext context, int root);
+ * void houserelays_memory_history (long long since, int dictionary,
+ *                                  int packed, RelaysWriter *writer);
  *
- *    Populate the context with an history of the input changes that occurred
+ *    Write to the current object an history of the input changes that occurred
  *    after the provided millisecond timestamp. If since is 0, return the
- *    complete recent history.
+ *    complete recent history. The list of names is omitted if dictionary
+ *    matches the current dictionary identifier, i.e. the client already
+ *    knows it.
+ *
+ *    If packed is true, the changes are not listed as a JSON array: they
+ *    are encoded as a sequence of unsigned varints (7 bits per byte, least
+ *    significant first, bit 7 set on all bytes except the last), two for
+ *    each change: the delay, followed by (index << 1) + value. The result
+ *    is encoded in URL-safe base64 without padding, as the "packed" item.
  *
  * void houserelays_memory_background (time_t now);
  *
@@ -63,11 +99,18 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <sys/time.h>
 
-#include "echttp_json.h"
+#include "echttp.h"
+
+#include "houselog.h"
 
+#include "houserelays_writer.h"
 #include "houserelays_memory.h"
+#include "houserelays_summary.h"
+#include "houserelays_metrics.h"
 
 struct MemoryRecord {
     unsigned int   delay;
@@ -75,7 +118,15 @@ struct MemoryRecord {
 };
 
 #define MEMORY_DEPTH 1024
-static struct MemoryRecord MemoryStore[MEMORY_DEPTH];
+#define MEMORY_CHECKPOINT 64 // Must be a power of 2.
+
+static struct MemoryRecord *MemoryStore = 0;
+static int MemoryDepth = MEMORY_DEPTH;
+static int MemoryRetention = 0; // Seconds, 0 means no limit.
+
+// One absolute timestamp for each slot that is a multiple of
+// MEMORY_CHECKPOINT. The depth is always a multiple of MEMORY_CHECKPOINT.
+static long long *MemoryCheckpoint = 0;
 
 static int MemoryNext = 0;
 static int MemoryOldest = 0;
@@ -84,39 +135,138 @@ static long long MemoryOldestTimestamp = 0; // Time of the oldest change.
 static long long MemoryNewestTimestamp = 0; // Time of the newest change.
 static long long MemoryScanTimestamp = 0;   // Time of the last scan.
 
-static const char **MemoryDictionary = 0;
+static char       **MemoryDictionary = 0; // Copies of the names.
 static int          MemoryDictionarySize = 0;
 static int          MemoryDictionaryCount = 0;
+static int          MemoryDictionaryId = 0; // Changes when names change.
 
 static int   MemorySamplingRate = 0;
 
+static int MemoryMetricStored = -1;
+static int MemoryMetricEvicted = -1;
+static int MemoryMetricOccupancy = -1;
+
+static unsigned char *MemoryPacked = 0;
+static int            MemoryPackedSize = 0;
+
+static void houserelays_memory_newdictionary (void) {
+
+    // Start from the current time, so that a client does not confuse
+    // a dictionary from before a restart with a new one.
+    if (MemoryDictionaryId <= 0)
+        MemoryDictionaryId = (int)(time(0) & 0x3fffffff);
+    MemoryDictionaryId += 1;
+}
+
+void houserelays_memory_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-history-depth=", argv[i], &value)) {
+            int depth = atoi (value);
+            if (depth <= MEMORY_CHECKPOINT) {
+                houselog_trace (HOUSE_FAILURE, "HISTORY",
+                                "history depth %d is too small, using %d\n",
+                                depth, 2 * MEMORY_CHECKPOINT);
+                depth = 2 * MEMORY_CHECKPOINT;
+            }
+            MemoryDepth = depth;
+            continue;
+        }
+        if (echttp_option_match ("-history-retention=", argv[i], &value)) {
+            MemoryRetention = atoi (value);
+            if (MemoryRetention < 0) MemoryRetention = 0;
+            continue;
+        }
+    }
+    MemoryDepth = (MemoryDepth + MEMORY_CHECKPOINT - 1)
+                      & (~(MEMORY_CHECKPOINT - 1));
+
+    MemoryMetricStored = houserelays_metrics_counter
+        ("houserelays_history_stored_total", "Number of changes recorded.");
+    MemoryMetricEvicted = houserelays_metrics_counter
+        ("houserelays_history_evicted_total",
+         "Number of changes removed because the history was full.");
+    MemoryMetricOccupancy = houserelays_metrics_gauge
+        ("houserelays_history_changes", "Number of changes in the history.");
+
+    if (MemoryStore) free (MemoryStore);
+    MemoryStore = calloc (MemoryDepth, sizeof(struct MemoryRecord));
+    if (MemoryCheckpoint) free (MemoryCheckpoint);
+    MemoryCheckpoint =
+        calloc (MemoryDepth / MEMORY_CHECKPOINT, sizeof(long long));
+    MemoryNext = MemoryOldest = 0;
+    MemoryNewestTimestamp = MemoryOldestTimestamp = 0;
+}
+
 void houserelays_memory_reset (int size, int rate) {
 
+    if (!MemoryStore) houserelays_memory_initialize (0, 0);
+
+    int i;
+    for (i = 0; i < MemoryDictionaryCount; ++i) free (MemoryDictionary[i]);
+
     if (size > MemoryDictionarySize) {
         if (MemoryDictionary) free (MemoryDictionary);
         MemoryDictionary = calloc (size, sizeof (char *));
         MemoryDictionarySize = size;
     }
     MemoryDictionaryCount = 0;
+    houserelays_memory_newdictionary ();
     MemoryNext = MemoryOldest = 0;
     MemoryNewestTimestamp = MemoryOldestTimestamp = 0;
 
     MemorySamplingRate = rate;
+    houserelays_summary_reset (size);
 }
 
-int houserelays_memory_add (const char *name) {
+void houserelays_memory_rate (int rate) {
+    MemorySamplingRate = rate;
+}
+
+int houserelays_memory_add (const char *name, int state) {
 
     if (MemoryDictionaryCount >= MemoryDictionarySize) return -1;
+    char *copy = strdup (name);
+    if (!copy) return -1;
     int index = MemoryDictionaryCount++;
-    MemoryDictionary[index] = name;
+    MemoryDictionary[index] = copy;
+    houserelays_summary_add (index, copy, state);
+    houserelays_memory_newdictionary ();
     return index;
 }
 
+void houserelays_memory_rename (int index, const char *name) {
+
+    if ((index < 0) || (index >= MemoryDictionaryCount)) return;
+    if (!strcmp (MemoryDictionary[index], name)) return;
+
+    char *copy = strdup (name);
+    if (!copy) return;
+    free (MemoryDictionary[index]);
+    MemoryDictionary[index] = copy;
+    houserelays_summary_rename (index, copy);
+    houserelays_memory_newdictionary ();
+}
+
+void houserelays_memory_remove (int index) {
+
+    if ((index < 0) || (index >= MemoryDictionaryCount)) return;
+    houserelays_summary_remove (index);
+}
+
 static int houserelays_memory_next (int index) {
-    if (++index >= MEMORY_DEPTH) index = 0;
+    if (++index >= MemoryDepth) index = 0;
     return index;
 }
 
+static void houserelays_memory_evict (void) {
+    MemoryOldestTimestamp += MemoryStore[MemoryOldest].delay;
+    MemoryOldest = houserelays_memory_next (MemoryOldest);
+    houserelays_metrics_add (MemoryMetricEvicted, 1);
+}
+
 void houserelays_memory_store (long long timestamp, int index, int state) {
 
     if ((index < 0) || (index >= MemoryDictionaryCount)) return; // Invalid.
@@ -125,56 +275,140 @@ void houserelays_memory_store (long long timestamp, int index, int state) {
 
     if (MemoryOldestTimestamp == 0)
         MemoryOldestTimestamp = MemoryNewestTimestamp = timestamp;
+    else if (timestamp < MemoryNewestTimestamp)
+        timestamp = MemoryNewestTimestamp; // Delays cannot be negative.
 
     MemoryNext = houserelays_memory_next (MemoryNext);
     if (MemoryNext == MemoryOldest) {
        // Remove the oldest change and move on to the next
-       MemoryOldestTimestamp += MemoryStore[MemoryOldest].delay;
-       MemoryOldest = houserelays_memory_next (MemoryOldest);
+       houserelays_memory_evict ();
     }
+    houserelays_metrics_add (MemoryMetricStored, 1);
+    houserelays_metrics_set (MemoryMetricOccupancy,
+        (MemoryNext - MemoryOldest + MemoryDepth) % MemoryDepth);
 
     MemoryStore[cursor].delay =
        (unsigned int) (timestamp - MemoryNewestTimestamp);
     MemoryStore[cursor].point = (unsigned int)index | (state?0x80000000u:0);
     MemoryNewestTimestamp = timestamp;
+
+    if ((cursor & (MEMORY_CHECKPOINT - 1)) == 0)
+        MemoryCheckpoint[cursor / MEMORY_CHECKPOINT] = timestamp;
+
+    // The summaries were already closed up to the last scan.
+    if (timestamp < MemoryScanTimestamp) timestamp = MemoryScanTimestamp;
+    houserelays_summary_store (timestamp, index, state);
 }
 
 void houserelays_memory_done (long long timestamp) {
     MemoryScanTimestamp = timestamp;
+    houserelays_summary_done (timestamp);
+}
+
+static int houserelays_memory_varint (unsigned char *buffer,
+                                      unsigned int value) {
+    int length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (unsigned char)value;
+    return length;
 }
 
-void houserelays_memory_history (long long since,
-                                 ParserContext context, int root) {
+static void houserelays_memory_pack (int i, long long adjust,
+                                     RelaysWriter *writer) {
+
+    // Each change takes at most 10 bytes (two 5 bytes varints).
+    int needed = MemoryDepth * 10;
+    if (needed > MemoryPackedSize) {
+        if (MemoryPacked) free (MemoryPacked);
+        MemoryPacked = malloc (needed);
+        MemoryPackedSize = needed;
+    }
+
+    int length = 0;
+    for (; i != MemoryNext; i = houserelays_memory_next (i)) {
+        unsigned int delay = (unsigned int)(MemoryStore[i].delay + adjust);
+        unsigned int point = ((MemoryStore[i].point & 0x7fffffff) << 1)
+                                 | ((MemoryStore[i].point & 0x80000000)?1:0);
+        length += houserelays_memory_varint (MemoryPacked+length, delay);
+        length += houserelays_memory_varint (MemoryPacked+length, point);
+        adjust = 0;
+    }
+    houserelays_writer_base64 (writer, "packed", MemoryPacked, length);
+}
+
+void houserelays_memory_history (long long since, int dictionary, int packed,
+                                 RelaysWriter *writer) {
 
     if (since == 0) since = MemoryOldestTimestamp;
 
-    echttp_json_add_integer (context, root, "start", since);
-    echttp_json_add_integer (context, root, "step", MemorySamplingRate);
-    echttp_json_add_integer (context, root, "end", MemoryScanTimestamp-since);
+    houserelays_writer_integer (writer, "start", since);
+    houserelays_writer_integer (writer, "step", MemorySamplingRate);
+    houserelays_writer_integer (writer, "end", MemoryScanTimestamp-since);
+    houserelays_writer_integer (writer, "dictionary", MemoryDictionaryId);
 
     // Attach the list of points, to interpret the index values provided
-    // in the history below.
-    int top = echttp_json_add_array (context, root, "names");
-    int i;
-    for (i = 0; i < MemoryDictionaryCount; ++i) {
-        echttp_json_add_string (context, top, 0, MemoryDictionary[i]);
+    // in the history below, unless the client already has it.
+    if (dictionary != MemoryDictionaryId) {
+        houserelays_writer_array (writer, "names");
+        int i;
+        for (i = 0; i < MemoryDictionaryCount; ++i) {
+            houserelays_writer_string (writer, 0, MemoryDictionary[i]);
+        }
+        houserelays_writer_end (writer);
     }
 
     // List all the changes that occurred after "since"
 
     if (MemoryNewestTimestamp <= since) return; // No new data.
 
+    // Search for the most recent checkpoint that is not more recent than
+    // since, and walk from there. The start variable is then the time of
+    // the change that precedes the first change to report.
+    //
+    int i = MemoryOldest;
     long long start = MemoryOldestTimestamp;
-    for (i = MemoryOldest; i != MemoryNext; i = houserelays_memory_next (i)) {
+    int used = MemoryNext - MemoryOldest;
+    if (used < 0) used += MemoryDepth;
+
+    int first = (MEMORY_CHECKPOINT - (MemoryOldest & (MEMORY_CHECKPOINT - 1)))
+                    & (MEMORY_CHECKPOINT - 1);
+    if (first < used) {
+        int low = 0;
+        int high = (used - first - 1) / MEMORY_CHECKPOINT;
+        int found = -1;
+        while (low <= high) {
+            int middle = (low + high) / 2;
+            int slot = (MemoryOldest + first + middle * MEMORY_CHECKPOINT)
+                           % MemoryDepth;
+            if (MemoryCheckpoint[slot / MEMORY_CHECKPOINT] <= since) {
+                found = slot;
+                low = middle + 1;
+            } else {
+                high = middle - 1;
+            }
+        }
+        if (found >= 0) {
+            start = MemoryCheckpoint[found / MEMORY_CHECKPOINT];
+            i = houserelays_memory_next (found);
+        }
+    }
+    for (; i != MemoryNext; i = houserelays_memory_next (i)) {
         long long changetime = start + MemoryStore[i].delay;
         if (changetime > since) break; // That change is more recent.
         start = changetime;
     }
 
+    if (packed) {
+        houserelays_memory_pack (i, start - since, writer);
+        return;
+    }
+
     int adjust = 1; // Adjust the first delay.
-    top = echttp_json_add_array (context, root, "data");
+    houserelays_writer_array (writer, "data");
     for (; i != MemoryNext; i = houserelays_memory_next (i)) {
-        int change = echttp_json_add_array (context, top, 0);
         int value = (MemoryStore[i].point & 0x80000000)?1:0;
         int index = MemoryStore[i].point & 0x7fffffff;
         long long adjusted = MemoryStore[i].delay;
@@ -182,10 +416,13 @@ void houserelays_memory_history (long long since,
            adjusted += (start - since);
            adjust = 0;
         }
-        echttp_json_add_integer (context, change, 0, adjusted);
-        echttp_json_add_integer (context, change, 0, index);
-        echttp_json_add_integer (context, change, 0, value);
+        houserelays_writer_array (writer, 0);
+        houserelays_writer_integer (writer, 0, adjusted);
+        houserelays_writer_integer (writer, 0, index);
+        houserelays_writer_integer (writer, 0, value);
+        houserelays_writer_end (writer);
     }
+    houserelays_writer_end (writer);
 }
 
 void houserelays_memory_background (time_t now) {
@@ -195,6 +432,18 @@ void houserelays_memory_background (time_t now) {
     if (MemoryNewestTimestamp / 1000 < now - 3600) {
         MemoryNext = MemoryOldest = 0;
         MemoryNewestTimestamp = MemoryOldestTimestamp = 0;
+        return;
+    }
+
+    // Remove the changes that are older than the retention period.
+    //
+    if (MemoryRetention > 0) {
+        long long limit = 1000LL * (now - MemoryRetention);
+        while (MemoryOldest != MemoryNext) {
+            if (MemoryOldestTimestamp + MemoryStore[MemoryOldest].delay
+                    >= limit) break;
+            houserelays_memory_evict ();
+        }
     }
 }
 
@@ -19,11 +19,15 @@
  *
  * houserelays_memory.h - A mechanism to record GPIO changes of state.
  */
+void houserelays_memory_initialize (int argc, const char **argv);
 void houserelays_memory_reset (int count, int rate);
-int  houserelays_memory_add (const char *name);
+void houserelays_memory_rate (int rate);
+int  houserelays_memory_add (const char *name, int state);
+void houserelays_memory_rename (int index, const char *name);
+void houserelays_memory_remove (int index);
 void houserelays_memory_store (long long timestamp, int index, int state);
 void houserelays_memory_done  (long long timestamp);
-void houserelays_memory_history (long long since,
-                                 ParserContext context, int root);
+void houserelays_memory_history (long long since, int dictionary, int packed,
+                                 RelaysWriter *writer);
 void houserelays_memory_background (time_t now);
 
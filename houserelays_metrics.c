@@ -0,0 +1,312 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_metrics.c - Counters and latency histograms.
+ *
+ * This module maintains simple performance metrics: counters, gauges
+ * and histograms of durations with fixed buckets. Each metric is declared
+ * once, typically when a module is initialized, and is then updated
+ * through its handle, which costs only a few instructions.
+ *
+ * The metrics can be exported in JSON or in the Prometheus text format.
+ * The durations are recorded in microseconds, and are exported in
+ * microseconds in JSON and in seconds in the Prometheus format.
+ *
+ * SYNOPSYS:
+ *
+ * int houserelays_metrics_counter (const char *name, const char *help);
+ * int houserelays_metrics_gauge   (const char *name, const char *help);
+ * int houserelays_metrics_histogram (const char *name, const char *label,
+ *                                    const char *value, const char *help);
+ *
+ *    Declare a metric and return its handle, or -1 if there is no room
+ *    left. Declaring the same metric again returns the same handle. A
+ *    histogram may have one label: all the histograms with the same name
+ *    must be declared one after the other. The strings must be static.
+ *
+ * long long houserelays_metrics_clock (void);
+ *
+ *    Return a monotonic time in microseconds, to measure durations.
+ *
+ * void houserelays_metrics_add (int metric, long long value);
+ *
+ *    Add the value to a counter.
+ *
+ * void houserelays_metrics_set (int metric, long long value);
+ *
+ *    Set the value of a gauge.
+ *
+ * void houserelays_metrics_observe (int metric, long long microseconds);
+ *
+ *    Record one duration in a histogram.
+ *
+ * void houserelays_metrics_json (RelaysWriter *writer);
+ *
+ *    Write all the metrics to the current object.
+ *
+ * const char *houserelays_metrics_prometheus (void);
+ *
+ *    Return all the metrics in the Prometheus text format. The text
+ *    remains valid until the next call.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "houserelays_writer.h"
+#include "houserelays_metrics.h"
+
+#define METRICS_MAX 64
+
+#define METRICS_COUNTER   1
+#define METRICS_GAUGE     2
+#define METRICS_HISTOGRAM 3
+
+// The upper bound of each histogram bucket, in microseconds. There is
+// an additional bucket for anything larger.
+static const long long MetricsBounds[] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000
+};
+#define METRICS_BUCKETS (sizeof(MetricsBounds)/sizeof(MetricsBounds[0]))
+
+struct RelaysMetric {
+    const char *name;
+    const char *label;
+    const char *value;
+    const char *help;
+    int type;
+    long long count; // Counter or gauge value, or number of samples.
+    long long sum;
+    long long buckets[METRICS_BUCKETS+1];
+};
+
+static struct RelaysMetric Metrics[METRICS_MAX];
+static int MetricsCount = 0;
+
+static char *MetricsText = 0;
+static int   MetricsTextSize = 0;
+static int   MetricsTextLength = 0;
+
+static int houserelays_metrics_declare (int type,
+                                        const char *name, const char *label,
+                                        const char *value, const char *help) {
+    int i;
+    for (i = 0; i < MetricsCount; ++i) {
+        if (strcmp (Metrics[i].name, name)) continue;
+        if ((!value) && (!Metrics[i].value)) return i;
+        if (value && Metrics[i].value && (!strcmp (Metrics[i].value, value)))
+            return i;
+    }
+    if (MetricsCount >= METRICS_MAX) return -1;
+
+    struct RelaysMetric *metric = Metrics + MetricsCount;
+    memset (metric, 0, sizeof(*metric));
+    metric->type = type;
+    metric->name = name;
+    metric->label = label;
+    metric->value = value;
+    metric->help = help;
+    return MetricsCount++;
+}
+
+int houserelays_metrics_counter (const char *name, const char *help) {
+    return houserelays_metrics_declare (METRICS_COUNTER, name, 0, 0, help);
+}
+
+int houserelays_metrics_gauge (const char *name, const char *help) {
+    return houserelays_metrics_declare (METRICS_GAUGE, name, 0, 0, help);
+}
+
+int houserelays_metrics_histogram (const char *name, const char *label,
+                                   const char *value, const char *help) {
+    return houserelays_metrics_declare
+               (METRICS_HISTOGRAM, name, label, value, help);
+}
+
+long long houserelays_metrics_clock (void) {
+
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (1000000LL * now.tv_sec) + now.tv_nsec / 1000;
+}
+
+void houserelays_metrics_add (int metric, long long value) {
+    if ((metric < 0) || (metric >= MetricsCount)) return;
+    Metrics[metric].count += value;
+}
+
+void houserelays_metrics_set (int metric, long long value) {
+    if ((metric < 0) || (metric >= MetricsCount)) return;
+    Metrics[metric].count = value;
+}
+
+void houserelays_metrics_observe (int metric, long long microseconds) {
+
+    if ((metric < 0) || (metric >= MetricsCount)) return;
+    struct RelaysMetric *histogram = Metrics + metric;
+
+    int i;
+    for (i = 0; i < METRICS_BUCKETS; ++i) {
+        if (microseconds <= MetricsBounds[i]) break;
+    }
+    histogram->buckets[i] += 1;
+    histogram->count += 1;
+    histogram->sum += microseconds;
+}
+
+void houserelays_metrics_json (RelaysWriter *writer) {
+
+    int i;
+    for (i = 0; i < MetricsCount; ++i) {
+        struct RelaysMetric *metric = Metrics + i;
+
+        if (metric->type != METRICS_HISTOGRAM) {
+            houserelays_writer_integer (writer, metric->name, metric->count);
+            continue;
+        }
+
+        // The histograms with the same name are grouped by label value.
+        int grouped = (metric->value != 0);
+        if (grouped) {
+            if ((i == 0) || strcmp (Metrics[i-1].name, metric->name))
+                houserelays_writer_object (writer, metric->name);
+            houserelays_writer_object (writer, metric->value);
+        } else {
+            houserelays_writer_object (writer, metric->name);
+        }
+        houserelays_writer_integer (writer, "count", metric->count);
+        houserelays_writer_integer (writer, "sum", metric->sum);
+        houserelays_writer_array (writer, "buckets");
+        int j;
+        long long cumulated = 0;
+        for (j = 0; j <= METRICS_BUCKETS; ++j) {
+            cumulated += metric->buckets[j];
+            houserelays_writer_array (writer, 0);
+            if (j < METRICS_BUCKETS)
+                houserelays_writer_integer (writer, 0, MetricsBounds[j]);
+            else
+                houserelays_writer_string (writer, 0, "+Inf");
+            houserelays_writer_integer (writer, 0, cumulated);
+            houserelays_writer_end (writer);
+        }
+        houserelays_writer_end (writer);
+        houserelays_writer_end (writer);
+
+        if (grouped) {
+            if ((i == MetricsCount - 1) || strcmp (Metrics[i+1].name, metric->name))
+                houserelays_writer_end (writer);
+        }
+    }
+}
+
+static void houserelays_metrics_print (const char *format, ...) {
+
+    if (MetricsTextSize <= 0) return; // Failed before.
+
+    for (;;) {
+        va_list args;
+        va_start (args, format);
+        int room = MetricsTextSize - MetricsTextLength;
+        int length = vsnprintf (MetricsText + MetricsTextLength,
+                                room, format, args);
+        va_end (args);
+        if (length < room) {
+            MetricsTextLength += length;
+            return;
+        }
+        char *text = realloc (MetricsText, 2 * MetricsTextSize);
+        if (!text) {
+            MetricsTextLength = 0;
+            MetricsText[0] = 0;
+            return;
+        }
+        MetricsText = text;
+        MetricsTextSize *= 2;
+    }
+}
+
+static void houserelays_metrics_seconds (char *buffer, int size,
+                                         long long microseconds) {
+    snprintf (buffer, size, "%lld.%06lld",
+              microseconds / 1000000, microseconds % 1000000);
+}
+
+const char *houserelays_metrics_prometheus (void) {
+
+    if (!MetricsText) {
+        MetricsTextSize = 16384;
+        MetricsText = malloc (MetricsTextSize);
+        if (!MetricsText) {
+            MetricsTextSize = 0;
+            return "";
+        }
+    }
+    MetricsTextLength = 0;
+    MetricsText[0] = 0;
+
+    int i;
+    for (i = 0; i < MetricsCount; ++i) {
+        struct RelaysMetric *metric = Metrics + i;
+
+        if ((i == 0) || strcmp (Metrics[i-1].name, metric->name)) {
+            static const char *types[] = {"", "counter", "gauge", "histogram"};
+            houserelays_metrics_print ("# HELP %s %s\n# TYPE %s %s\n",
+                                       metric->name, metric->help,
+                                       metric->name, types[metric->type]);
+        }
+
+        if (metric->type != METRICS_HISTOGRAM) {
+            houserelays_metrics_print ("%s %lld\n", metric->name, metric->count);
+            continue;
+        }
+
+        char label[128];
+        if (metric->value)
+            snprintf (label, sizeof(label), "%s=\"%s\",",
+                      metric->label, metric->value);
+        else
+            label[0] = 0;
+
+        int j;
+        long long cumulated = 0;
+        char bound[32];
+        for (j = 0; j <= METRICS_BUCKETS; ++j) {
+            cumulated += metric->buckets[j];
+            if (j < METRICS_BUCKETS)
+                houserelays_metrics_seconds
+                    (bound, sizeof(bound), MetricsBounds[j]);
+            else
+                strcpy (bound, "+Inf");
+            houserelays_metrics_print ("%s_bucket{%sle=\"%s\"} %lld\n",
+                                       metric->name, label, bound, cumulated);
+        }
+        if (label[0]) label[strlen(label)-1] = 0; // No trailing comma.
+        houserelays_metrics_seconds (bound, sizeof(bound), metric->sum);
+        houserelays_metrics_print ("%s_sum%s%s%s %s\n", metric->name,
+                                   label[0]?"{":"", label, label[0]?"}":"",
+                                   bound);
+        houserelays_metrics_print ("%s_count%s%s%s %lld\n", metric->name,
+                                   label[0]?"{":"", label, label[0]?"}":"",
+                                   metric->count);
+    }
+    return MetricsText;
+}
@@ -0,0 +1,34 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_metrics.h - Counters and latency histograms.
+ */
+int houserelays_metrics_counter   (const char *name, const char *help);
+int houserelays_metrics_gauge     (const char *name, const char *help);
+int houserelays_metrics_histogram (const char *name, const char *label,
+                                   const char *value, const char *help);
+
+long long houserelays_metrics_clock (void);
+
+void houserelays_metrics_add     (int metric, long long value);
+void houserelays_metrics_set     (int metric, long long value);
+void houserelays_metrics_observe (int metric, long long microseconds);
+
+void houserelays_metrics_json (RelaysWriter *writer);
+const char *houserelays_metrics_prometheus (void);
@@ -0,0 +1,335 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_sampler.c - Sample the inputs from a dedicated thread.
+ *
+ * This module runs the input scan in its own thread, at a real time
+ * priority when allowed, so that the sampling period does not depend on
+ * how busy the HTTP side is. The thread wakes up on a periodic timerfd,
+ * which deadlines are absolute: a late wakeup does not shift the next
+ * samples.
+ *
+ * The scan function detects the changes and pushes them into a lock-free
+ * queue with a single producer (the sampling thread) and a single consumer
+ * (the main loop). The main loop is woken up through an eventfd when
+ * changes were pushed, and then delivers the changes to the history.
+ * The queue has a fixed size: if the main loop falls too far behind, the
+ * new changes are dropped and counted. The scan function should then
+ * report that change again on the next scan.
+ *
+ * The number of scans, of missed periods (the thread woke up after the
+ * next deadline had already passed), of late scans (woke up more than a
+ * quarter of a period after the deadline) and of dropped changes are
+ * counted and reported.
+ *
+ * SYNOPSYS:
+ *
+ * int houserelays_sampler_start (int period, RelaysSamplerScan *scan,
+ *                                RelaysSamplerDeliver *deliver,
+ *                                RelaysSamplerDone *done);
+ *
+ *    Start the sampling thread, which calls scan every period (in
+ *    milliseconds). The main loop calls deliver for each change pushed
+ *    by scan, then done with the time of the latest scan and whether
+ *    deliver reported any change. Return 1 on success, 0 on failure.
+ *
+ * void houserelays_sampler_stop (void);
+ *
+ *    Stop the sampling thread and wait for it to terminate. The pending
+ *    changes are delivered first.
+ *
+ * int houserelays_sampler_active (void);
+ *
+ *    Return true if the sampling thread is running.
+ *
+ * int houserelays_sampler_push (long long timestamp, int point, int state);
+ *
+ *    Queue one change. This may only be called from the scan function.
+ *    Return 0 if the change was dropped because the queue is full.
+ *
+ * void houserelays_sampler_scanned (long long timestamp);
+ *
+ *    Mark the end of a scan. This may only be called from the scan
+ *    function.
+ *
+ * void houserelays_sampler_drain (void);
+ *
+ *    Deliver all the pending changes now. This is called automatically
+ *    when changes are pushed, but can be called before using the history.
+ *
+ * void houserelays_sampler_status (RelaysWriter *writer);
+ *
+ *    Write the sampling statistics to the current object.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "houserelays_writer.h"
+#include "houserelays_sampler.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define SAMPLER_QUEUE 4096 // Must be a power of 2.
+#define SAMPLER_PRIORITY 10
+
+struct SamplerRecord {
+    long long timestamp;
+    int point;
+    int state;
+};
+
+static struct SamplerRecord SamplerQueue[SAMPLER_QUEUE];
+static atomic_uint SamplerHead;  // Next record to write (producer).
+static atomic_uint SamplerTail;  // Next record to read (consumer).
+
+static atomic_llong  SamplerLastScan;
+static atomic_ulong  SamplerScans;
+static atomic_ulong  SamplerMissed;
+static atomic_ulong  SamplerLate;
+static atomic_ulong  SamplerDropped;
+static atomic_llong  SamplerWorst; // Worst wakeup delay, microseconds.
+static atomic_int    SamplerStopping;
+
+static int SamplerPushed = 0; // Used by the sampling thread only.
+
+static pthread_t SamplerThread;
+static int SamplerRunning = 0;
+static int SamplerRealtime = 0;
+static int SamplerPeriod = 0;
+static int SamplerEvent = -1;
+static int SamplerTimer = -1;
+
+static RelaysSamplerScan    *SamplerScan = 0;
+static RelaysSamplerDeliver *SamplerDeliver = 0;
+static RelaysSamplerDone    *SamplerDone = 0;
+
+int houserelays_sampler_push (long long timestamp, int point, int state) {
+
+    unsigned int head = atomic_load_explicit (&SamplerHead,
+                                              memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit (&SamplerTail,
+                                              memory_order_acquire);
+    if (head - tail >= SAMPLER_QUEUE) {
+        atomic_fetch_add_explicit (&SamplerDropped, 1, memory_order_relaxed);
+        return 0;
+    }
+    struct SamplerRecord *record = SamplerQueue + (head & (SAMPLER_QUEUE-1));
+    record->timestamp = timestamp;
+    record->point = point;
+    record->state = state;
+    atomic_store_explicit (&SamplerHead, head + 1, memory_order_release);
+    SamplerPushed += 1;
+    return 1;
+}
+
+void houserelays_sampler_scanned (long long timestamp) {
+
+    atomic_store_explicit (&SamplerLastScan, timestamp, memory_order_relaxed);
+    if (SamplerPushed) {
+        unsigned long long one = 1;
+        if (write (SamplerEvent, &one, sizeof(one)) < 0) {
+            // The counter is saturated: the main loop will wake up anyway.
+        }
+        SamplerPushed = 0;
+    }
+}
+
+static long long houserelays_sampler_clock (void) {
+
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (1000000LL * now.tv_sec) + now.tv_nsec / 1000;
+}
+
+static void *houserelays_sampler_loop (void *context) {
+
+    long long period = 1000LL * SamplerPeriod; // Microseconds.
+    long long deadline = houserelays_sampler_clock () + period;
+
+    struct itimerspec spec;
+    spec.it_value.tv_sec = deadline / 1000000;
+    spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    spec.it_interval.tv_sec = period / 1000000;
+    spec.it_interval.tv_nsec = (period % 1000000) * 1000;
+    if (timerfd_settime (SamplerTimer, TFD_TIMER_ABSTIME, &spec, 0))
+        return 0;
+
+    while (!atomic_load (&SamplerStopping)) {
+        unsigned long long expirations = 0;
+        if (read (SamplerTimer, &expirations, sizeof(expirations)) <= 0)
+            continue;
+        if (expirations > 1) {
+            atomic_fetch_add_explicit
+                (&SamplerMissed, expirations - 1, memory_order_relaxed);
+        }
+        deadline += expirations * period;
+
+        // The deadline that just passed is the previous one.
+        long long delay = houserelays_sampler_clock () - (deadline - period);
+        if (delay > period / 4)
+            atomic_fetch_add_explicit (&SamplerLate, 1, memory_order_relaxed);
+        if (delay > atomic_load_explicit (&SamplerWorst, memory_order_relaxed))
+            atomic_store_explicit (&SamplerWorst, delay, memory_order_relaxed);
+
+        SamplerScan ();
+        atomic_fetch_add_explicit (&SamplerScans, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+void houserelays_sampler_drain (void) {
+
+    if (!SamplerDeliver) return;
+
+    int changed = 0;
+    unsigned int tail = atomic_load_explicit (&SamplerTail,
+                                              memory_order_relaxed);
+    unsigned int head = atomic_load_explicit (&SamplerHead,
+                                              memory_order_acquire);
+    while (tail != head) {
+        struct SamplerRecord *record =
+            SamplerQueue + (tail & (SAMPLER_QUEUE-1));
+        changed |= SamplerDeliver
+                       (record->timestamp, record->point, record->state);
+        tail += 1;
+    }
+    atomic_store_explicit (&SamplerTail, tail, memory_order_release);
+
+    long long timestamp = atomic_load (&SamplerLastScan);
+    if (timestamp) SamplerDone (timestamp, changed);
+}
+
+static void houserelays_sampler_wakeup (int fd, int mode) {
+
+    unsigned long long count;
+    if (read (SamplerEvent, &count, sizeof(count)) < 0) {
+        // Nothing to read: maybe already drained.
+    }
+    houserelays_sampler_drain ();
+}
+
+int houserelays_sampler_start (int period, RelaysSamplerScan *scan,
+                               RelaysSamplerDeliver *deliver,
+                               RelaysSamplerDone *done) {
+
+    if (SamplerRunning) houserelays_sampler_stop ();
+
+    if (SamplerEvent < 0) {
+        SamplerEvent = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (SamplerEvent < 0) {
+            houselog_trace (HOUSE_FAILURE, "SAMPLER", "eventfd() failed");
+            return 0;
+        }
+        echttp_listen (SamplerEvent, 1, houserelays_sampler_wakeup, 0);
+    }
+    if (SamplerTimer < 0) {
+        SamplerTimer = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (SamplerTimer < 0) {
+            houselog_trace (HOUSE_FAILURE, "SAMPLER", "timerfd_create() failed");
+            return 0;
+        }
+    }
+
+    SamplerPeriod = period;
+    SamplerScan = scan;
+    SamplerDeliver = deliver;
+    SamplerDone = done;
+    SamplerPushed = 0;
+    atomic_store (&SamplerHead, 0);
+    atomic_store (&SamplerTail, 0);
+    atomic_store (&SamplerLastScan, 0);
+    atomic_store (&SamplerStopping, 0);
+
+    // Try a real time priority first, then fall back to a normal thread.
+    pthread_attr_t attr;
+    struct sched_param param;
+    pthread_attr_init (&attr);
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    param.sched_priority = SAMPLER_PRIORITY;
+    pthread_attr_setschedparam (&attr, &param);
+
+    SamplerRealtime = 1;
+    if (pthread_create (&SamplerThread, &attr,
+                        houserelays_sampler_loop, 0)) {
+        SamplerRealtime = 0;
+        if (pthread_create (&SamplerThread, 0,
+                            houserelays_sampler_loop, 0)) {
+            pthread_attr_destroy (&attr);
+            houselog_trace (HOUSE_FAILURE, "SAMPLER",
+                            "cannot create the sampling thread");
+            return 0;
+        }
+        houselog_trace (HOUSE_FAILURE, "SAMPLER",
+                        "no real time priority, using a normal thread");
+    }
+    pthread_attr_destroy (&attr);
+    SamplerRunning = 1;
+    DEBUG ("sampling thread started, period %d ms%s\n",
+           period, SamplerRealtime?" (real time)":"");
+    return 1;
+}
+
+void houserelays_sampler_stop (void) {
+
+    if (!SamplerRunning) return;
+
+    // The thread wakes up every period, so it will notice soon enough.
+    atomic_store (&SamplerStopping, 1);
+    pthread_join (SamplerThread, 0);
+    SamplerRunning = 0;
+    houserelays_sampler_drain ();
+
+    struct itimerspec spec;
+    memset (&spec, 0, sizeof(spec));
+    timerfd_settime (SamplerTimer, 0, &spec, 0);
+}
+
+int houserelays_sampler_active (void) {
+    return SamplerRunning;
+}
+
+void houserelays_sampler_status (RelaysWriter *writer) {
+
+    houserelays_writer_integer (writer, "period", SamplerPeriod);
+    houserelays_writer_bool (writer, "realtime", SamplerRealtime);
+    houserelays_writer_integer
+        (writer, "scans", (long long)atomic_load (&SamplerScans));
+    houserelays_writer_integer
+        (writer, "late", (long long)atomic_load (&SamplerLate));
+    houserelays_writer_integer
+        (writer, "missed", (long long)atomic_load (&SamplerMissed));
+    houserelays_writer_integer
+        (writer, "dropped", (long long)atomic_load (&SamplerDropped));
+    houserelays_writer_integer
+        (writer, "worst", atomic_load (&SamplerWorst));
+}
@@ -0,0 +1,36 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_sampler.h - Sample the inputs from a dedicated thread.
+ */
+typedef void RelaysSamplerScan    (void);
+typedef int  RelaysSamplerDeliver (long long timestamp, int point, int state);
+typedef void RelaysSamplerDone    (long long timestamp, int changed);
+
+int  houserelays_sampler_start (int period, RelaysSamplerScan *scan,
+                                RelaysSamplerDeliver *deliver,
+                                RelaysSamplerDone *done);
+void houserelays_sampler_stop  (void);
+int  houserelays_sampler_active (void);
+
+int  houserelays_sampler_push    (long long timestamp, int point, int state);
+void houserelays_sampler_scanned (long long timestamp);
+
+void houserelays_sampler_drain  (void);
+void houserelays_sampler_status (RelaysWriter *writer);
@@ -0,0 +1,485 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_sequence.c - Run a sequence of output steps locally.
+ *
+ * A sequence is a list of steps, each step setting a list of points to
+ * a state for a duration. The points of a step are latched when the step
+ * starts, and return to the state they had before the step when it ends,
+ * unless the next step controls them too. The end of a step and the start
+ * of the next step are applied as one single batch. A step with no point
+ * is just a delay. The sequence runs off its own timer, and does not
+ * depend on the client that submitted it.
+ *
+ * A sequence is submitted as a JSON object, for example:
+ *
+ *    {"name":"irrigation","steps":[
+ *        {"points":["valve1"],"state":"on","duration":600},
+ *        {"points":["valve2","valve3"],"state":"on","duration_ms":480000}
+ *    ]}
+ *
+ * The duration is in seconds, or in milliseconds if duration_ms is used.
+ * Submitting a sequence with the name of an existing sequence cancels
+ * that existing sequence first.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_sequence_remap (void);
+ *
+ *    Find the points of all sequences again, by name. This must be called
+ *    after the list of points changed, since the sequences refer to points
+ *    by index. A point that was removed is ignored from there on.
+ *
+ * const char *houserelays_sequence_load (const char *text);
+ *
+ *    Decode a new sequence and start it. Return 0 on success, or an
+ *    error message.
+ *
+ * int houserelays_sequence_control (const char *name, const char *action);
+ *
+ *    Apply the action (pause, resume or cancel) to the named sequence.
+ *    Pausing a sequence ends the current step immediately, and resuming
+ *    it restarts that step for its remaining duration. Return 0 on
+ *    success, -1 if the sequence is not known and -2 if the action
+ *    is not valid.
+ *
+ * void houserelays_sequence_status (RelaysWriter *writer);
+ *
+ *    Write the list of active sequences to the current object.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+
+#include "houselog.h"
+
+#include "houserelays.h"
+#include "houserelays_writer.h"
+#include "houserelays_gpio.h"
+#include "houserelays_timer.h"
+#include "houserelays_sequence.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define SEQUENCE_MAX 16
+
+struct RelaySequenceStep {
+    int count;
+    int *points;
+    char **names; // To find the points again after a configuration change.
+    int *states;
+    int *prior;   // The state of each point before the step started.
+    int duration; // Milliseconds.
+};
+
+struct RelaySequence {
+    char name[32];
+    int steps;    // 0: not used.
+    struct RelaySequenceStep *step;
+    int current;
+    int paused;
+    long long deadline;  // End of the current step, when running.
+    long long remaining; // Time left in the current step, when paused.
+};
+
+static struct RelaySequence RelaySequences[SEQUENCE_MAX];
+
+static void houserelays_sequence_free (struct RelaySequence *sequence) {
+
+    int i;
+    for (i = 0; i < sequence->steps; ++i) {
+        int j;
+        for (j = 0; j < sequence->step[i].count; ++j)
+            free (sequence->step[i].names[j]);
+        free (sequence->step[i].names);
+        free (sequence->step[i].points);
+        free (sequence->step[i].states);
+        free (sequence->step[i].prior);
+    }
+    if (sequence->step) free (sequence->step);
+    sequence->step = 0;
+    sequence->steps = 0;
+}
+
+static int houserelays_sequence_find (const struct RelaySequenceStep *step,
+                                      int point) {
+    int i;
+    for (i = 0; i < step->count; ++i) {
+        if (step->points[i] == point) return i;
+    }
+    return -1;
+}
+
+static void houserelays_sequence_switch (struct RelaySequence *sequence,
+                                         struct RelaySequenceStep *ending,
+                                         struct RelaySequenceStep *starting) {
+
+    // End one step and start another, in one batch. Either may be null.
+    // The points of the ending step that the starting step does not
+    // control return to the state they had before the ending step.
+    int size = (ending ? ending->count : 0) + (starting ? starting->count : 0);
+    if (size <= 0) return;
+
+    int *points = calloc (size, sizeof(int));
+    int *states = calloc (size, sizeof(int));
+    if ((!points) || (!states)) {
+        if (points) free (points);
+        if (states) free (states);
+        return;
+    }
+    int i;
+    int count = 0;
+    if (ending) {
+        for (i = 0; i < ending->count; ++i) {
+            int point = ending->points[i];
+            if (starting && (houserelays_sequence_find (starting, point) >= 0))
+                continue;
+            points[count] = point;
+            states[count++] = ending->prior[i];
+        }
+    }
+    if (starting) {
+        for (i = 0; i < starting->count; ++i) {
+            int point = starting->points[i];
+            int previous = -1;
+            if (ending) previous = houserelays_sequence_find (ending, point);
+            if (previous >= 0)
+                starting->prior[i] = ending->prior[previous];
+            else
+                starting->prior[i] = houserelays_gpio_commanded (point);
+            points[count] = point;
+            states[count++] = starting->states[i];
+        }
+    }
+    if (count > 0) {
+        houserelays_gpio_set_batch
+            (sequence->name, count, points, states, 0, "SEQUENCE");
+    }
+    free (points);
+    free (states);
+}
+
+static void houserelays_sequence_next (int index, long long now);
+
+static void houserelays_sequence_arm (int index, long long duration) {
+
+    struct RelaySequence *sequence = RelaySequences + index;
+
+    DEBUG ("sequence %s: step %d for %lld ms\n",
+           sequence->name, sequence->current, duration);
+    sequence->deadline = houserelays_timer_now() + duration;
+    houserelays_timer_set
+        (sequence->deadline, houserelays_sequence_next, index);
+}
+
+static void houserelays_sequence_advance (int index, int active) {
+
+    // Move to the next step. If the current step is active, its points
+    // are released at the same time.
+    struct RelaySequence *sequence = RelaySequences + index;
+    struct RelaySequenceStep *ending =
+        active ? sequence->step + sequence->current : 0;
+
+    sequence->current += 1;
+    if (sequence->current >= sequence->steps) {
+        houserelays_sequence_switch (sequence, ending, 0);
+        houselog_event ("SEQUENCE", sequence->name, "COMPLETED", "");
+        houserelays_sequence_free (sequence);
+        return;
+    }
+    struct RelaySequenceStep *starting = sequence->step + sequence->current;
+    houserelays_sequence_switch (sequence, ending, starting);
+    houserelays_sequence_arm (index, starting->duration);
+}
+
+static void houserelays_sequence_next (int index, long long now) {
+
+    struct RelaySequence *sequence = RelaySequences + index;
+    if ((sequence->steps <= 0) || sequence->paused) return;
+    houserelays_sequence_advance (index, 1);
+}
+
+static void houserelays_sequence_cancel (int index) {
+
+    struct RelaySequence *sequence = RelaySequences + index;
+    if (sequence->steps <= 0) return;
+
+    houserelays_timer_cancel (houserelays_sequence_next, index);
+    if (!sequence->paused) {
+        houserelays_sequence_switch
+            (sequence, sequence->step + sequence->current, 0);
+    }
+    houselog_event ("SEQUENCE", sequence->name, "CANCELLED",
+                    "AT STEP %d", sequence->current + 1);
+    houserelays_sequence_free (sequence);
+}
+
+static int houserelays_sequence_search (const char *name) {
+
+    int i;
+    for (i = 0; i < SEQUENCE_MAX; ++i) {
+        if (RelaySequences[i].steps <= 0) continue;
+        if (!strcmp (RelaySequences[i].name, name)) return i;
+    }
+    return -1;
+}
+
+void houserelays_sequence_remap (void) {
+
+    int i;
+    for (i = 0; i < SEQUENCE_MAX; ++i) {
+        struct RelaySequence *sequence = RelaySequences + i;
+        int j;
+        for (j = 0; j < sequence->steps; ++j) {
+            struct RelaySequenceStep *step = sequence->step + j;
+            int k;
+            for (k = 0; k < step->count; ++k)
+                step->points[k] = houserelays_gpio_search (step->names[k]);
+        }
+    }
+}
+
+static const char *houserelays_sequence_step (struct RelaySequenceStep *step,
+                                              ParserToken *json) {
+
+    int state = 1;
+    int i = echttp_json_search (json, ".state");
+    if (i >= 0) {
+        switch (json[i].type) {
+        case PARSER_STRING:
+            if (!strcmp (json[i].value.string, "on")) state = 1;
+            else if (!strcmp (json[i].value.string, "off")) state = 0;
+            else return "invalid step state";
+            break;
+        case PARSER_INTEGER: state = (json[i].value.integer != 0); break;
+        case PARSER_BOOL:    state = json[i].value.bool; break;
+        default: return "invalid step state";
+        }
+    }
+
+    long long duration = 0;
+    i = echttp_json_search (json, ".duration_ms");
+    if ((i >= 0) && (json[i].type == PARSER_INTEGER)) {
+        duration = json[i].value.integer;
+    } else {
+        i = echttp_json_search (json, ".duration");
+        if ((i >= 0) && (json[i].type == PARSER_INTEGER))
+            duration = 1000 * json[i].value.integer;
+    }
+    if ((duration <= 0) || (duration > 0x7fffffff))
+        return "invalid step duration";
+    step->duration = (int)duration;
+
+    i = echttp_json_search (json, ".points");
+    if (i < 0) return 0; // A delay step.
+    if (json[i].type != PARSER_ARRAY) return "invalid step points";
+
+    ParserToken *points = json + i;
+    int count = points->length;
+    if (count <= 0) return 0;
+
+    int *list = calloc (count, sizeof(int));
+    step->points = calloc (count, sizeof(int));
+    step->names = calloc (count, sizeof(char *));
+    step->states = calloc (count, sizeof(int));
+    step->prior = calloc (count, sizeof(int));
+    if ((!list) || (!step->points) || (!step->names) ||
+        (!step->states) || (!step->prior)) {
+        if (list) free (list);
+        return "no more memory";
+    }
+    const char *error = echttp_json_enumerate (points, list, count);
+    if (error) {
+        free (list);
+        return error;
+    }
+    for (i = 0; i < count; ++i) {
+        ParserToken *item = points + list[i];
+        if (item->type != PARSER_STRING) {
+            free (list);
+            return "invalid point name";
+        }
+        int point = houserelays_gpio_search (item->value.string);
+        if (point < 0) {
+            free (list);
+            return "unknown point";
+        }
+        step->names[step->count] = strdup (item->value.string);
+        if (!step->names[step->count]) {
+            free (list);
+            return "no more memory";
+        }
+        step->points[step->count] = point;
+        step->states[step->count++] = state;
+    }
+    free (list);
+    return 0;
+}
+
+static const char *houserelays_sequence_decode (struct RelaySequence *sequence,
+                                                ParserToken *json) {
+
+    int i = echttp_json_search (json, ".name");
+    if ((i < 0) || (json[i].type != PARSER_STRING) || (!json[i].value.string[0]))
+        return "missing sequence name";
+    snprintf (sequence->name, sizeof(sequence->name),
+              "%s", json[i].value.string);
+
+    i = echttp_json_search (json, ".steps");
+    if ((i < 0) || (json[i].type != PARSER_ARRAY)) return "missing steps";
+
+    ParserToken *steps = json + i;
+    int count = steps->length;
+    if (count <= 0) return "no step";
+
+    int *list = calloc (count, sizeof(int));
+    sequence->step = calloc (count, sizeof(struct RelaySequenceStep));
+    if ((!list) || (!sequence->step)) {
+        if (list) free (list);
+        return "no more memory";
+    }
+    sequence->steps = count;
+
+    const char *error = echttp_json_enumerate (steps, list, count);
+    for (i = 0; (i < count) && (!error); ++i) {
+        ParserToken *step = steps + list[i];
+        if (step->type != PARSER_OBJECT)
+            error = "invalid step";
+        else
+            error = houserelays_sequence_step (sequence->step + i, step);
+    }
+    free (list);
+    return error;
+}
+
+const char *houserelays_sequence_load (const char *text) {
+
+    int i;
+    int index = -1;
+    for (i = 0; i < SEQUENCE_MAX; ++i) {
+        if (RelaySequences[i].steps <= 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) return "too many sequences";
+
+    char *json = strdup (text);
+    if (!json) return "no more memory";
+    int count = echttp_json_estimate (json);
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    if (!tokens) {
+        free (json);
+        return "no more memory";
+    }
+    const char *error = echttp_json_parse (json, tokens, &count);
+
+    struct RelaySequence *sequence = RelaySequences + index;
+    if (!error) error = houserelays_sequence_decode (sequence, tokens);
+    free (tokens);
+    free (json);
+
+    if (error) {
+        houserelays_sequence_free (sequence);
+        return error;
+    }
+
+    // A new sequence replaces any older one with the same name.
+    for (i = 0; i < SEQUENCE_MAX; ++i) {
+        if ((i == index) || (RelaySequences[i].steps <= 0)) continue;
+        if (!strcmp (RelaySequences[i].name, sequence->name))
+            houserelays_sequence_cancel (i);
+    }
+
+    houselog_event ("SEQUENCE", sequence->name, "STARTED",
+                    "%d STEPS", sequence->steps);
+    sequence->current = 0;
+    sequence->paused = 0;
+    houserelays_sequence_switch (sequence, 0, sequence->step);
+    houserelays_sequence_arm (index, sequence->step[0].duration);
+    return 0;
+}
+
+int houserelays_sequence_control (const char *name, const char *action) {
+
+    int index = houserelays_sequence_search (name);
+    if (index < 0) return -1;
+
+    struct RelaySequence *sequence = RelaySequences + index;
+
+    if (!strcmp (action, "cancel")) {
+        houserelays_sequence_cancel (index);
+
+    } else if (!strcmp (action, "pause")) {
+        if (sequence->paused) return 0;
+        houserelays_timer_cancel (houserelays_sequence_next, index);
+        sequence->remaining = sequence->deadline - houserelays_timer_now();
+        if (sequence->remaining < 0) sequence->remaining = 0;
+        houserelays_sequence_switch
+            (sequence, sequence->step + sequence->current, 0);
+        sequence->paused = 1;
+        houselog_event ("SEQUENCE", sequence->name, "PAUSED",
+                        "AT STEP %d", sequence->current + 1);
+
+    } else if (!strcmp (action, "resume")) {
+        if (!sequence->paused) return 0;
+        sequence->paused = 0;
+        houselog_event ("SEQUENCE", sequence->name, "RESUMED",
+                        "AT STEP %d", sequence->current + 1);
+        if (sequence->remaining > 0) {
+            houserelays_sequence_switch
+                (sequence, 0, sequence->step + sequence->current);
+            houserelays_sequence_arm (index, sequence->remaining);
+        } else {
+            houserelays_sequence_advance (index, 0);
+        }
+
+    } else {
+        return -2;
+    }
+    return 0;
+}
+
+void houserelays_sequence_status (RelaysWriter *writer) {
+
+    long long now = houserelays_timer_now();
+
+    int i;
+    for (i = 0; i < SEQUENCE_MAX; ++i) {
+        struct RelaySequence *sequence = RelaySequences + i;
+        if (sequence->steps <= 0) continue;
+
+        long long remaining = sequence->paused ?
+                                 sequence->remaining : sequence->deadline - now;
+        if (remaining < 0) remaining = 0;
+
+        houserelays_writer_object (writer, sequence->name);
+        houserelays_writer_string
+            (writer, "state", sequence->paused ? "paused" : "running");
+        houserelays_writer_integer (writer, "step", sequence->current + 1);
+        houserelays_writer_integer (writer, "steps", sequence->steps);
+        houserelays_writer_integer (writer, "remaining", remaining);
+        houserelays_writer_end (writer);
+    }
+}
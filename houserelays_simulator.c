@@ -0,0 +1,451 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_simulator.c - A simulated GPIO hardware.
+ *
+ * This module implements the GPIO backend interface (see houserelays_gpiod.c)
+ * without any hardware, kernel module or privilege. Any chip path can be
+ * opened. The outputs keep the value they were set to, while the inputs
+ * follow a waveform, i.e. a list of timed changes loaded from a file:
+ *
+ *    # time(ms) chip line value
+ *    0     0  17 0
+ *    12.5  0  17 1
+ *    20    0  17 0
+ *    repeat 25
+ *
+ * The time is relative to the start of the waveform, in milliseconds (with
+ * decimals). The chip is the number N of the /dev/gpiochipN device. The
+ * optional repeat line defines the period of the waveform: without it, the
+ * waveform is played only once.
+ *
+ * The waveform may be played faster than real time, using the
+ * -simulator-speed option: with -simulator-speed=10, the changes of a 10
+ * seconds waveform are played in 1 second. The input values are computed
+ * when the inputs are read, and edge events are signaled through a timerfd
+ * set at the time of the next change, so that the timing does not depend
+ * on the sampling period. When edge events are requested, the input
+ * changes are applied only when the events are read, so that no change
+ * is missed. The outputs and the inputs may be accessed from the sampling
+ * thread (see houserelays_sampler.c): each chip has its own lock.
+ *
+ * SYNOPSYS:
+ *
+ * const char *houserelays_simulator_initialize (int argc, const char **argv);
+ *
+ *    Load the waveform (-simulator-waveform=FILE) and set the playback speed
+ *    (-simulator-speed=N). Return 0 on success, an error message otherwise.
+ *
+ * const RelaysBackend *houserelays_simulator_backend (void);
+ *
+ *    Return the simulator backend.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+
+#include "echttp.h"
+
+#include "houserelays_backend.h"
+#include "houserelays_simulator.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+#define SIMULATOR_CHIPS 16
+#define SIMULATOR_LINES 1024
+
+struct SimulatorChange {
+    long long time; // Microseconds since the start of the waveform.
+    int chip;
+    unsigned int line;
+    int value;
+};
+
+static struct SimulatorChange *SimulatorWaveform = 0;
+static int SimulatorWaveformCount = 0;
+static long long SimulatorRepeat = 0; // Microseconds, 0: play once.
+static double SimulatorSpeed = 1.0;
+
+// The waveform starts when the simulator is initialized. The wall clock
+// at that time is used to timestamp the edge events.
+static long long SimulatorStart = 0;     // Monotonic, microseconds.
+static long long SimulatorStartReal = 0; // System time, microseconds.
+
+#define SIMULATOR_INPUT  1
+#define SIMULATOR_OUTPUT 2
+#define SIMULATOR_EDGES  4
+
+struct SimulatorChip {
+    char path[128];
+    int number;
+    int requested;
+    int next;          // Next change in the waveform.
+    long long cycle;   // Start of the current waveform cycle (microseconds).
+    int timerfd;
+    pthread_mutex_t lock; // Protects next, cycle and values.
+    int values[SIMULATOR_LINES];
+    char modes[SIMULATOR_LINES];
+};
+
+static struct SimulatorChip SimulatorChips[SIMULATOR_CHIPS];
+static int SimulatorChipCount = 0;
+
+static long long houserelays_simulator_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (1000000LL * now.tv_sec) + now.tv_nsec / 1000;
+}
+
+// Convert a waveform time into the monotonic clock.
+static long long houserelays_simulator_due (long long time) {
+    return SimulatorStart + (long long)(time / SimulatorSpeed);
+}
+
+static const char *houserelays_simulator_load (const char *path) {
+
+    FILE *file = fopen (path, "r");
+    if (!file) return "cannot open the waveform file";
+
+    int size = 0;
+    char buffer[256];
+    while (fgets (buffer, sizeof(buffer), file)) {
+        double time;
+        int chip;
+        unsigned int line;
+        int value;
+
+        if ((buffer[0] == '#') || (buffer[0] == '\n')) continue;
+        if (sscanf (buffer, "repeat %lf", &time) == 1) {
+            SimulatorRepeat = (long long)(time * 1000);
+            continue;
+        }
+        if (sscanf (buffer, "%lf %d %u %d", &time, &chip, &line, &value) != 4)
+            continue;
+        if ((time < 0) || (line >= SIMULATOR_LINES)) continue;
+
+        if (SimulatorWaveformCount >= size) {
+            size = size ? 2 * size : 256;
+            struct SimulatorChange *waveform =
+                realloc (SimulatorWaveform, size * sizeof(*waveform));
+            if (!waveform) {
+                fclose (file);
+                return "no more memory";
+            }
+            SimulatorWaveform = waveform;
+        }
+        // Keep the waveform sorted by time. The file is normally sorted
+        // already, and changes at the same time are kept in file order.
+        struct SimulatorChange change;
+        change.time = (long long)(time * 1000);
+        change.chip = chip;
+        change.line = line;
+        change.value = value ? 1 : 0;
+
+        int i = SimulatorWaveformCount++;
+        while ((i > 0) && (SimulatorWaveform[i-1].time > change.time)) {
+            SimulatorWaveform[i] = SimulatorWaveform[i-1];
+            i -= 1;
+        }
+        SimulatorWaveform[i] = change;
+    }
+    fclose (file);
+
+    if (SimulatorWaveformCount > 0) {
+        long long last = SimulatorWaveform[SimulatorWaveformCount-1].time;
+        if (SimulatorRepeat > 0 && SimulatorRepeat <= last)
+            SimulatorRepeat = last + 1;
+    } else {
+        SimulatorRepeat = 0;
+    }
+    DEBUG ("simulator: loaded %d changes from %s, repeat every %lld us\n",
+           SimulatorWaveformCount, path, SimulatorRepeat);
+    return 0;
+}
+
+const char *houserelays_simulator_initialize (int argc, const char **argv) {
+
+    int i;
+    const char *value;
+    const char *waveform = 0;
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-simulator-waveform=", argv[i], &waveform))
+            continue;
+        if (echttp_option_match ("-simulator-speed=", argv[i], &value)) {
+            SimulatorSpeed = atof (value);
+            if (SimulatorSpeed <= 0) SimulatorSpeed = 1.0;
+            continue;
+        }
+    }
+
+    struct timeval now;
+    gettimeofday (&now, 0);
+    SimulatorStartReal = (1000000LL * now.tv_sec) + now.tv_usec;
+    SimulatorStart = houserelays_simulator_clock ();
+
+    if (waveform) return houserelays_simulator_load (waveform);
+    return 0;
+}
+
+// Apply all the waveform changes that are due for this chip. Return the
+// number of edge events, which are stored in events if not null. The
+// changes are applied even when no event is requested.
+//
+static int houserelays_simulator_play (struct SimulatorChip *chip,
+                                       RelaysEdgeEvent *events, int max) {
+
+    if (SimulatorWaveformCount <= 0) return 0;
+
+    int count = 0;
+    long long now = houserelays_simulator_clock ();
+
+    for (;;) {
+        if (chip->next >= SimulatorWaveformCount) {
+            if (SimulatorRepeat <= 0) break;
+            chip->next = 0;
+            chip->cycle += SimulatorRepeat;
+        }
+        struct SimulatorChange *change = SimulatorWaveform + chip->next;
+        long long time = chip->cycle + change->time;
+        if (houserelays_simulator_due (time) > now) break;
+
+        if ((change->chip == chip->number) &&
+            (chip->modes[change->line] & SIMULATOR_INPUT) &&
+            (chip->values[change->line] != change->value)) {
+
+            if (chip->modes[change->line] & SIMULATOR_EDGES) {
+                if (events) {
+                    if (count >= max) break; // Keep it for the next call.
+                    RelaysEdgeEvent *event = events + count;
+                    event->offset = change->line;
+                    event->state = change->value;
+                    event->timestamp = (SimulatorStartReal +
+                        (long long)(time / SimulatorSpeed)) / 1000;
+                }
+                count += 1;
+            }
+            chip->values[change->line] = change->value;
+        }
+        chip->next += 1;
+    }
+    return count;
+}
+
+static void houserelays_simulator_arm (struct SimulatorChip *chip) {
+
+    if (chip->timerfd < 0) return;
+
+    struct itimerspec timer;
+    memset (&timer, 0, sizeof(timer));
+
+    int next = chip->next;
+    long long cycle = chip->cycle;
+    if (next >= SimulatorWaveformCount) {
+        if (SimulatorRepeat <= 0) return; // Nothing more to play.
+        next = 0;
+        cycle += SimulatorRepeat;
+    }
+    long long due =
+        houserelays_simulator_due (cycle + SimulatorWaveform[next].time);
+    timer.it_value.tv_sec = due / 1000000;
+    timer.it_value.tv_nsec = (due % 1000000) * 1000;
+    if ((!timer.it_value.tv_sec) && (!timer.it_value.tv_nsec))
+        timer.it_value.tv_nsec = 1; // Zero would disarm the timer.
+    timerfd_settime (chip->timerfd, TFD_TIMER_ABSTIME, &timer, 0);
+}
+
+static void *houserelays_simulator_open (const char *path) {
+
+    int i;
+    for (i = 0; i < SimulatorChipCount; ++i) {
+        if (!strcmp (SimulatorChips[i].path, path)) return SimulatorChips + i;
+    }
+    if (SimulatorChipCount >= SIMULATOR_CHIPS) return 0;
+
+    struct SimulatorChip *chip = SimulatorChips + SimulatorChipCount++;
+    memset (chip, 0, sizeof(*chip));
+    snprintf (chip->path, sizeof(chip->path), "%s", path);
+    const char *number = path + strcspn (path, "0123456789");
+    chip->number = atoi (number);
+    chip->timerfd = -1;
+    pthread_mutex_init (&chip->lock, 0);
+    return chip;
+}
+
+static void houserelays_simulator_close (void *chip) {
+    // Nothing to do: the simulated chip stays, as a real chip would.
+}
+
+static int houserelays_simulator_line (struct SimulatorChip *chip,
+                                       const RelaysLineConfig *line) {
+
+    if (line->direction == RELAYS_LINE_OUTPUT) {
+        chip->modes[line->offset] = SIMULATOR_OUTPUT;
+        chip->values[line->offset] = line->value ? 1 : 0;
+        return 0;
+    }
+    chip->modes[line->offset] = SIMULATOR_INPUT;
+    if (!line->edges) return 0;
+    chip->modes[line->offset] |= SIMULATOR_EDGES;
+    return 1;
+}
+
+static void *houserelays_simulator_request (void *handle, int count,
+                                            const RelaysLineConfig *lines) {
+
+    struct SimulatorChip *chip = (struct SimulatorChip *)handle;
+    if (chip->requested) return 0; // Busy.
+
+    int i;
+    int edges = 0;
+    for (i = 0; i < count; ++i) {
+        if ((lines[i].offset >= SIMULATOR_LINES) ||
+            chip->modes[lines[i].offset]) { // Invalid or duplicate.
+            memset (chip->modes, 0, sizeof(chip->modes));
+            return 0;
+        }
+        edges |= houserelays_simulator_line (chip, lines + i);
+    }
+
+    // Catch up with the waveform, without reporting the past changes.
+    houserelays_simulator_play (chip, 0, 0);
+
+    if (edges) {
+        chip->timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+        houserelays_simulator_arm (chip);
+    }
+    chip->requested = 1;
+    return chip;
+}
+
+static int houserelays_simulator_reconfigure (void *request, int count,
+                                              const RelaysLineConfig *lines) {
+
+    struct SimulatorChip *chip = (struct SimulatorChip *)request;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (lines[i].offset >= SIMULATOR_LINES) return -1;
+        if (!chip->modes[lines[i].offset]) return -1; // Not requested.
+    }
+    int edges = 0;
+    for (i = 0; i < count; ++i) {
+        edges |= houserelays_simulator_line (chip, lines + i);
+    }
+    if (edges && (chip->timerfd < 0)) {
+        chip->timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+        houserelays_simulator_arm (chip);
+    } else if ((!edges) && (chip->timerfd >= 0)) {
+        close (chip->timerfd);
+        chip->timerfd = -1;
+    }
+    return 0;
+}
+
+static void houserelays_simulator_release (void *request) {
+
+    struct SimulatorChip *chip = (struct SimulatorChip *)request;
+    if (chip->timerfd >= 0) close (chip->timerfd);
+    chip->timerfd = -1;
+    memset (chip->modes, 0, sizeof(chip->modes));
+    chip->requested = 0;
+}
+
+static int houserelays_simulator_get (void *request, int count,
+                                      const unsigned int *offsets,
+                                      int *values) {
+
+    struct SimulatorChip *chip = (struct SimulatorChip *)request;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (offsets[i] >= SIMULATOR_LINES) return -1;
+        if (!chip->modes[offsets[i]]) return -1;
+    }
+    pthread_mutex_lock (&chip->lock);
+
+    // With edge events, the changes are left for the events to report.
+    if (chip->timerfd < 0) houserelays_simulator_play (chip, 0, 0);
+
+    for (i = 0; i < count; ++i) values[i] = chip->values[offsets[i]];
+    pthread_mutex_unlock (&chip->lock);
+    return 0;
+}
+
+static int houserelays_simulator_set (void *request, int count,
+                                      const unsigned int *offsets,
+                                      const int *values) {
+
+    struct SimulatorChip *chip = (struct SimulatorChip *)request;
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (offsets[i] >= SIMULATOR_LINES) return -1;
+        if (!(chip->modes[offsets[i]] & SIMULATOR_OUTPUT)) return -1;
+    }
+    pthread_mutex_lock (&chip->lock);
+    for (i = 0; i < count; ++i) {
+        chip->values[offsets[i]] = values[i] ? 1 : 0;
+    }
+    pthread_mutex_unlock (&chip->lock);
+    return 0;
+}
+
+static int houserelays_simulator_fd (void *request) {
+    return ((struct SimulatorChip *)request)->timerfd;
+}
+
+static int houserelays_simulator_events (void *request,
+                                         RelaysEdgeEvent *events, int max) {
+
+    struct SimulatorChip *chip = (struct SimulatorChip *)request;
+    if (chip->timerfd < 0) return -1;
+
+    unsigned long long expirations;
+    if (read (chip->timerfd, &expirations, sizeof(expirations)) < 0) {
+        // Not expired yet: nothing to report.
+    }
+    pthread_mutex_lock (&chip->lock);
+    int count = houserelays_simulator_play (chip, events, max);
+    houserelays_simulator_arm (chip);
+    pthread_mutex_unlock (&chip->lock);
+    return count;
+}
+
+static const RelaysBackend SimulatorBackend = {
+    "simulator",
+    houserelays_simulator_open,
+    houserelays_simulator_close,
+    houserelays_simulator_request,
+    houserelays_simulator_release,
+    houserelays_simulator_get,
+    houserelays_simulator_set,
+    houserelays_simulator_fd,
+    houserelays_simulator_events,
+    houserelays_simulator_reconfigure
+};
+
+const RelaysBackend *houserelays_simulator_backend (void) {
+    return &SimulatorBackend;
+}
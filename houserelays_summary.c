@@ -0,0 +1,279 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_summary.c - Summaries of the input changes per time window.
+ *
+ * This module maintains, for each input point, a few statistics per
+ * one second bucket: the number of changes, how long the input was on,
+ * and its state at the end of the bucket. The buckets are updated as the
+ * changes are stored, and are kept in a circular buffer that covers the
+ * last SUMMARY_DEPTH seconds. A request for summaries over larger windows
+ * only adds up the buckets in each window: it never walks the changes.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_summary_reset (int count);
+ *
+ *    Erase all summaries. Count is the maximum number of points.
+ *
+ * void houserelays_summary_add (int index, const char *name, int state);
+ *
+ *    Declare one input point and its current state. The lifetime of the
+ *    name is controlled by the caller: it must last at least until the
+ *    next reset, or until the point is renamed.
+ *
+ * void houserelays_summary_rename (int index, const char *name);
+ *
+ *    Change the name of an input point, keeping its summaries.
+ *
+ * void houserelays_summary_remove (int index);
+ *
+ *    Forget an input point: its summaries are not reported anymore, and
+ *    it does not accumulate on time.
+ *
+ * void houserelays_summary_store (long long timestamp, int index, int state);
+ *
+ *    Account for one input change. A change older than the current
+ *    bucket is accounted for at the start of the current bucket.
+ *
+ * void houserelays_summary_done (long long timestamp);
+ *
+ *    Close the buckets that ended before this time, even if no change
+ *    occurred.
+ *
+ * void houserelays_summary_write (long long since, int window,
+ *                                 RelaysWriter *writer);
+ *
+ *    Write to the current object the summaries of all windows that
+ *    started at or after since and that are complete. The window is in
+ *    milliseconds, and is rounded up to a whole number of seconds. The
+ *    windows are aligned on multiples of their duration, so that
+ *    consecutive requests see the same windows.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "houserelays_writer.h"
+#include "houserelays_summary.h"
+
+#define SUMMARY_PERIOD 1000 // Milliseconds per bucket.
+#define SUMMARY_DEPTH  900  // Number of buckets kept.
+
+#define SUMMARY_STATE 0x8000 // In ontime: state at the end of the bucket.
+
+struct SummaryBucket {
+    unsigned short changes;
+    unsigned short ontime; // Milliseconds.
+};
+
+// The buckets are stored by time first: all points for one bucket, then
+// all points for the next bucket, etc.
+static struct SummaryBucket *SummaryStore = 0;
+
+static const char **SummaryName = 0;
+static int *SummaryState = 0;
+static long long *SummaryMark = 0; // Time since which the on time is due.
+static int SummarySize = 0;
+static int SummaryCount = 0;
+
+static long long SummaryCurrent = 0; // Start of the current bucket.
+static int SummaryHead = 0;          // Position of the current bucket.
+static int SummaryComplete = 0;      // Number of complete buckets.
+
+void houserelays_summary_reset (int count) {
+
+    if (count > SummarySize) {
+        if (SummaryStore) free (SummaryStore);
+        SummaryStore = calloc (SUMMARY_DEPTH * count,
+                               sizeof(struct SummaryBucket));
+        if (SummaryName) free (SummaryName);
+        SummaryName = calloc (count, sizeof(const char *));
+        if (SummaryState) free (SummaryState);
+        SummaryState = calloc (count, sizeof(int));
+        if (SummaryMark) free (SummaryMark);
+        SummaryMark = calloc (count, sizeof(long long));
+        SummarySize = count;
+        if ((!SummaryStore) || (!SummaryName) ||
+            (!SummaryState) || (!SummaryMark)) SummarySize = 0;
+    }
+    SummaryCount = 0;
+    SummaryCurrent = 0;
+    SummaryHead = 0;
+    SummaryComplete = 0;
+}
+
+void houserelays_summary_add (int index, const char *name, int state) {
+
+    if ((index < 0) || (index >= SummarySize)) return;
+    SummaryName[index] = name;
+    SummaryState[index] = state;
+    SummaryMark[index] = SummaryCurrent;
+    if (index >= SummaryCount) SummaryCount = index + 1;
+}
+
+void houserelays_summary_rename (int index, const char *name) {
+    if ((index < 0) || (index >= SummaryCount)) return;
+    SummaryName[index] = name;
+}
+
+void houserelays_summary_remove (int index) {
+
+    if ((index < 0) || (index >= SummaryCount)) return;
+    SummaryName[index] = 0;
+    SummaryState[index] = 0;
+}
+
+static struct SummaryBucket *houserelays_summary_bucket (int position) {
+    return SummaryStore + (position * SummarySize);
+}
+
+static void houserelays_summary_close (void) {
+
+    // Account for the on time up to the end of the current bucket,
+    // then move on to the next bucket.
+    long long end = SummaryCurrent + SUMMARY_PERIOD;
+    struct SummaryBucket *bucket = houserelays_summary_bucket (SummaryHead);
+    int i;
+    for (i = 0; i < SummaryCount; ++i) {
+        if (SummaryState[i]) {
+            bucket[i].ontime += (unsigned short)(end - SummaryMark[i]);
+            bucket[i].ontime |= SUMMARY_STATE;
+        }
+        SummaryMark[i] = end;
+    }
+    SummaryCurrent = end;
+    if (++SummaryHead >= SUMMARY_DEPTH) SummaryHead = 0;
+    if (SummaryComplete < SUMMARY_DEPTH - 1) SummaryComplete += 1;
+    memset (houserelays_summary_bucket (SummaryHead), 0,
+            SummaryCount * sizeof(struct SummaryBucket));
+}
+
+void houserelays_summary_done (long long timestamp) {
+
+    if (SummarySize <= 0) return;
+
+    if (!SummaryCurrent) {
+        SummaryCurrent = timestamp - (timestamp % SUMMARY_PERIOD);
+        int i;
+        for (i = 0; i < SummaryCount; ++i) SummaryMark[i] = timestamp;
+        memset (houserelays_summary_bucket (SummaryHead), 0,
+                SummaryCount * sizeof(struct SummaryBucket));
+        return;
+    }
+
+    // After a long silence, skip the buckets that would be overwritten
+    // anyway: the loop below then clears the whole buffer.
+    long long limit = timestamp - (SUMMARY_DEPTH * SUMMARY_PERIOD);
+    if (SummaryCurrent < limit) {
+        SummaryCurrent = limit - (limit % SUMMARY_PERIOD);
+        int i;
+        for (i = 0; i < SummaryCount; ++i) SummaryMark[i] = SummaryCurrent;
+        memset (houserelays_summary_bucket (SummaryHead), 0,
+                SummaryCount * sizeof(struct SummaryBucket));
+    }
+    while (timestamp >= SummaryCurrent + SUMMARY_PERIOD)
+        houserelays_summary_close ();
+}
+
+void houserelays_summary_store (long long timestamp, int index, int state) {
+
+    if ((index < 0) || (index >= SummaryCount)) return;
+
+    houserelays_summary_done (timestamp);
+
+    // A change may be reported after its bucket was closed, e.g. an edge
+    // event read after a history request. It is then accounted for at the
+    // start of the current bucket.
+    if (timestamp < SummaryMark[index]) timestamp = SummaryMark[index];
+
+    struct SummaryBucket *bucket =
+        houserelays_summary_bucket (SummaryHead) + index;
+    if (SummaryState[index]) {
+        bucket->ontime += (unsigned short)(timestamp - SummaryMark[index]);
+    }
+    SummaryMark[index] = timestamp;
+    SummaryState[index] = state;
+    if (bucket->changes < 0xffff) bucket->changes += 1;
+}
+
+void houserelays_summary_write (long long since, int window,
+                                RelaysWriter *writer) {
+
+    if (window < SUMMARY_PERIOD) window = SUMMARY_PERIOD;
+    window = ((window + SUMMARY_PERIOD - 1) / SUMMARY_PERIOD) * SUMMARY_PERIOD;
+
+    long long oldest = SummaryCurrent - (SummaryComplete * SUMMARY_PERIOD);
+    if (since < oldest) since = oldest;
+    long long start = ((since + window - 1) / window) * window;
+    long long end = (SummaryCurrent / window) * window;
+    int windows = (end > start) ? (int)((end - start) / window) : 0;
+    int buckets = window / SUMMARY_PERIOD;
+
+    houserelays_writer_integer (writer, "start", start);
+    houserelays_writer_integer (writer, "window", window);
+    houserelays_writer_integer (writer, "end", windows ? end : start);
+    houserelays_writer_object (writer, "points");
+
+    int i;
+    for (i = 0; (i < SummaryCount) && SummaryCurrent; ++i) {
+        if (!SummaryName[i]) continue;
+        houserelays_writer_object (writer, SummaryName[i]);
+
+        // The position of the bucket that starts at this window start.
+        int first = SummaryHead - (int)((SummaryCurrent - start) / SUMMARY_PERIOD);
+        while (first < 0) first += SUMMARY_DEPTH;
+
+        int w, b;
+        houserelays_writer_array (writer, "state");
+        for (w = 0; w < windows; ++w) {
+            int last = (first + ((w + 1) * buckets) - 1) % SUMMARY_DEPTH;
+            houserelays_writer_integer (writer, 0,
+                (houserelays_summary_bucket (last)[i].ontime & SUMMARY_STATE) != 0);
+        }
+        houserelays_writer_end (writer);
+
+        houserelays_writer_array (writer, "changes");
+        for (w = 0; w < windows; ++w) {
+            long long changes = 0;
+            for (b = 0; b < buckets; ++b) {
+                int position = (first + (w * buckets) + b) % SUMMARY_DEPTH;
+                changes += houserelays_summary_bucket (position)[i].changes;
+            }
+            houserelays_writer_integer (writer, 0, changes);
+        }
+        houserelays_writer_end (writer);
+
+        // The duty cycle is the percentage of time the input was on.
+        houserelays_writer_array (writer, "duty");
+        for (w = 0; w < windows; ++w) {
+            long long ontime = 0;
+            for (b = 0; b < buckets; ++b) {
+                int position = (first + (w * buckets) + b) % SUMMARY_DEPTH;
+                ontime += houserelays_summary_bucket (position)[i].ontime
+                              & (~SUMMARY_STATE);
+            }
+            houserelays_writer_integer (writer, 0, (ontime * 100) / window);
+        }
+        houserelays_writer_end (writer);
+
+        houserelays_writer_end (writer);
+    }
+    houserelays_writer_end (writer);
+}
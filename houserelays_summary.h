@@ -0,0 +1,29 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_summary.h - Summaries of the input changes per time window.
+ */
+void houserelays_summary_reset (int count);
+void houserelays_summary_add   (int index, const char *name, int state);
+void houserelays_summary_rename (int index, const char *name);
+void houserelays_summary_remove (int index);
+void houserelays_summary_store (long long timestamp, int index, int state);
+void houserelays_summary_done  (long long timestamp);
+void houserelays_summary_write (long long since, int window,
+                                RelaysWriter *writer);
@@ -0,0 +1,309 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_timer.c - Schedule actions at a millisecond deadline.
+ *
+ * This module maintains a list of pending timers, each with its deadline,
+ * a callback and a context value for the callback. The timers are kept in
+ * a binary heap sorted by deadline, and a single timerfd is armed for the
+ * earliest deadline only. That timerfd is part of the echttp loop, so
+ * each callback is called as soon as its deadline is reached. Nothing is
+ * scheduled when no timer is pending. The position of each timer in the
+ * heap is recorded per callback and context, so that a timer is found
+ * without searching the heap.
+ *
+ * The deadlines are in milliseconds and use the monotonic clock, so that
+ * changes to the system time have no impact on the timers.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_timer_initialize (void);
+ *
+ *    Create the timerfd and register it with echttp.
+ *
+ * long long houserelays_timer_now (void);
+ *
+ *    Return the current time in milliseconds, as used for deadlines.
+ *
+ * void houserelays_timer_set (long long deadline,
+ *                             RelaysTimerCallback *callback, int context);
+ *
+ *    Call the callback with the context at the deadline. There is only
+ *    one timer for a given callback and context: setting it again
+ *    replaces the previous deadline. The context must not be negative.
+ *
+ * void houserelays_timer_cancel (RelaysTimerCallback *callback, int context);
+ *
+ *    Remove the timer for this callback and context, if any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "echttp.h"
+
+#include "houselog.h"
+
+#include "houserelays_timer.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+struct RelaysTimer {
+    long long deadline;
+    RelaysTimerCallback *callback;
+    int context;
+    int slot; // Index in TimerSlots.
+};
+
+// There are only a few different callbacks. For each callback, the
+// position of each context's timer in the heap, -1 if none.
+#define TIMER_CALLBACKS 16
+
+struct RelaysTimerSlot {
+    RelaysTimerCallback *callback;
+    int *position;
+    int size;
+};
+
+static struct RelaysTimerSlot TimerSlots[TIMER_CALLBACKS];
+static int TimerSlotCount = 0;
+
+static struct RelaysTimer *TimerHeap = 0;
+static int TimerCount = 0;
+static int TimerSize = 0;
+
+// Working storage for the timers that expired.
+static struct RelaysTimer *TimerExpired = 0;
+static int TimerExpiredSize = 0;
+
+static int TimerFd = -1;
+static long long TimerArmed = 0; // 0: not armed.
+
+long long houserelays_timer_now (void) {
+
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (1000LL * now.tv_sec) + now.tv_nsec / 1000000;
+}
+
+static void houserelays_timer_arm (void) {
+
+    long long deadline = (TimerCount > 0) ? TimerHeap[0].deadline : 0;
+    if (deadline == TimerArmed) return;
+
+    struct itimerspec spec;
+    memset (&spec, 0, sizeof(spec));
+    if (deadline) {
+        spec.it_value.tv_sec = deadline / 1000;
+        spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+        // A zero value would disarm the timer.
+        if ((!spec.it_value.tv_sec) && (!spec.it_value.tv_nsec))
+            spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime (TimerFd, TFD_TIMER_ABSTIME, &spec, 0)) {
+        houselog_trace (HOUSE_FAILURE, "TIMER", "timerfd_settime() failed");
+        return;
+    }
+    TimerArmed = deadline;
+}
+
+static void houserelays_timer_place (int i) {
+    struct RelaysTimer *timer = TimerHeap + i;
+    TimerSlots[timer->slot].position[timer->context] = i;
+}
+
+static void houserelays_timer_swap (int a, int b) {
+    struct RelaysTimer t = TimerHeap[a];
+    TimerHeap[a] = TimerHeap[b];
+    TimerHeap[b] = t;
+    houserelays_timer_place (a);
+    houserelays_timer_place (b);
+}
+
+static void houserelays_timer_up (int i) {
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (TimerHeap[parent].deadline <= TimerHeap[i].deadline) break;
+        houserelays_timer_swap (i, parent);
+        i = parent;
+    }
+}
+
+static void houserelays_timer_down (int i) {
+
+    for (;;) {
+        int smallest = i;
+        int left = (2 * i) + 1;
+        int right = left + 1;
+        if ((left < TimerCount) &&
+            (TimerHeap[left].deadline < TimerHeap[smallest].deadline))
+            smallest = left;
+        if ((right < TimerCount) &&
+            (TimerHeap[right].deadline < TimerHeap[smallest].deadline))
+            smallest = right;
+        if (smallest == i) break;
+        houserelays_timer_swap (i, smallest);
+        i = smallest;
+    }
+}
+
+static void houserelays_timer_remove (int i) {
+
+    TimerSlots[TimerHeap[i].slot].position[TimerHeap[i].context] = -1;
+    TimerCount -= 1;
+    if (i >= TimerCount) return;
+    TimerHeap[i] = TimerHeap[TimerCount];
+    houserelays_timer_place (i);
+    houserelays_timer_down (i);
+    houserelays_timer_up (i);
+}
+
+static int houserelays_timer_slot (RelaysTimerCallback *callback,
+                                   int context, int create) {
+
+    // Return the slot of this callback, with room for this context,
+    // or -1 if there is none.
+    if (context < 0) return -1;
+
+    int i;
+    for (i = 0; i < TimerSlotCount; ++i) {
+        if (TimerSlots[i].callback == callback) break;
+    }
+    if (i >= TimerSlotCount) {
+        if ((!create) || (TimerSlotCount >= TIMER_CALLBACKS)) return -1;
+        TimerSlots[i].callback = callback;
+        TimerSlots[i].position = 0;
+        TimerSlots[i].size = 0;
+        TimerSlotCount += 1;
+    }
+    struct RelaysTimerSlot *slot = TimerSlots + i;
+    if (context < slot->size) return i;
+    if (!create) return -1;
+
+    int size = slot->size ? slot->size : 64;
+    while (size <= context) size *= 2;
+    int *position = realloc (slot->position, size * sizeof(int));
+    if (!position) return -1;
+    int j;
+    for (j = slot->size; j < size; ++j) position[j] = -1;
+    slot->position = position;
+    slot->size = size;
+    return i;
+}
+
+static int houserelays_timer_find (RelaysTimerCallback *callback,
+                                   int context) {
+    int slot = houserelays_timer_slot (callback, context, 0);
+    if (slot < 0) return -1;
+    return TimerSlots[slot].position[context];
+}
+
+static void houserelays_timer_expire (int fd, int mode) {
+
+    unsigned long long expirations;
+    if (read (TimerFd, &expirations, sizeof(expirations)) < 0) {
+        // Spurious wakeup: the timer was rearmed meanwhile.
+    }
+    TimerArmed = 0;
+
+    // Take all the expired timers out of the heap before calling any
+    // callback, since the callbacks may set new timers.
+    long long now = houserelays_timer_now ();
+    int count = 0;
+    while ((TimerCount > 0) && (TimerHeap[0].deadline <= now)) {
+        if (count >= TimerExpiredSize) {
+            struct RelaysTimer *expired =
+                realloc (TimerExpired, TimerSize * sizeof(struct RelaysTimer));
+            if (!expired) break; // Try again later.
+            TimerExpired = expired;
+            TimerExpiredSize = TimerSize;
+        }
+        TimerExpired[count++] = TimerHeap[0];
+        houserelays_timer_remove (0);
+    }
+    houserelays_timer_arm ();
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        DEBUG ("timer %d expired %lld ms late\n",
+               TimerExpired[i].context, now - TimerExpired[i].deadline);
+        TimerExpired[i].callback (TimerExpired[i].context, now);
+    }
+}
+
+void houserelays_timer_initialize (void) {
+
+    TimerFd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (TimerFd < 0) {
+        houselog_trace (HOUSE_FAILURE, "TIMER", "timerfd_create() failed");
+        return;
+    }
+    echttp_listen (TimerFd, 1, houserelays_timer_expire, 1);
+}
+
+void houserelays_timer_set (long long deadline,
+                            RelaysTimerCallback *callback, int context) {
+
+    int slot = houserelays_timer_slot (callback, context, 1);
+    if (slot < 0) {
+        houselog_trace (HOUSE_FAILURE, "TIMER", "cannot register timer");
+        return;
+    }
+    int i = TimerSlots[slot].position[context];
+    if (i >= 0) {
+        TimerHeap[i].deadline = deadline;
+        houserelays_timer_down (i);
+        houserelays_timer_up (i);
+        houserelays_timer_arm ();
+        return;
+    }
+
+    if (TimerCount >= TimerSize) {
+        int size = TimerSize ? (2 * TimerSize) : 64;
+        struct RelaysTimer *heap =
+            realloc (TimerHeap, size * sizeof(struct RelaysTimer));
+        if (!heap) {
+            houselog_trace (HOUSE_FAILURE, "TIMER", "no more memory");
+            return;
+        }
+        TimerHeap = heap;
+        TimerSize = size;
+    }
+    i = TimerCount++;
+    TimerHeap[i].deadline = deadline;
+    TimerHeap[i].callback = callback;
+    TimerHeap[i].context = context;
+    TimerHeap[i].slot = slot;
+    houserelays_timer_place (i);
+    houserelays_timer_up (i);
+    houserelays_timer_arm ();
+}
+
+void houserelays_timer_cancel (RelaysTimerCallback *callback, int context) {
+
+    int i = houserelays_timer_find (callback, context);
+    if (i < 0) return;
+    houserelays_timer_remove (i);
+    houserelays_timer_arm ();
+}
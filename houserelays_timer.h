@@ -0,0 +1,30 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_timer.h - Schedule actions at a millisecond deadline.
+ */
+typedef void RelaysTimerCallback (int context, long long now);
+
+void houserelays_timer_initialize (void);
+
+long long houserelays_timer_now (void);
+
+void houserelays_timer_set    (long long deadline,
+                               RelaysTimerCallback *callback, int context);
+void houserelays_timer_cancel (RelaysTimerCallback *callback, int context);
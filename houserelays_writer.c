@@ -0,0 +1,247 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_writer.c - Write a JSON response as data is visited.
+ *
+ * This module generates JSON text directly, without building a tree of
+ * tokens first. The text is written to a buffer that grows as needed and
+ * is reused from one response to the next, so there is no fixed limit
+ * on the size of a response and no per-request memory.
+ *
+ * Each writer keeps track of the current nesting, so that the caller
+ * does not need to handle separators.
+ *
+ * SYNOPSYS:
+ *
+ * void houserelays_writer_start (RelaysWriter *writer);
+ *
+ *    Start a new JSON document, discarding any previous content.
+ *
+ * void houserelays_writer_object (RelaysWriter *writer, const char *key);
+ * void houserelays_writer_array  (RelaysWriter *writer, const char *key);
+ *
+ *    Open a new object or array. The key must be 0 if the parent is
+ *    an array (or if this is the top object).
+ *
+ * void houserelays_writer_end (RelaysWriter *writer);
+ *
+ *    Close the current object or array.
+ *
+ * void houserelays_writer_string  (RelaysWriter *writer,
+ *                                  const char *key, const char *value);
+ * void houserelays_writer_integer (RelaysWriter *writer,
+ *                                  const char *key, long long value);
+ * void houserelays_writer_bool    (RelaysWriter *writer,
+ *                                  const char *key, int value);
+ *
+ *    Add one value to the current object or array. The key must be 0 if
+ *    the parent is an array.
+ *
+ * void houserelays_writer_base64 (RelaysWriter *writer, const char *key,
+ *                                 const unsigned char *data, int length);
+ *
+ *    Add a binary value, encoded as an URL-safe base64 string without
+ *    padding.
+ *
+ * const char *houserelays_writer_export (RelaysWriter *writer);
+ *
+ *    Close all pending objects and arrays and return the JSON text.
+ *    Return 0 if the text could not be generated (no more memory).
+ *    The text remains valid until the next start.
+ *
+ * int houserelays_writer_length (const RelaysWriter *writer);
+ *
+ *    Return the length of the JSON text generated so far.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "houserelays_writer.h"
+
+#define WRITER_INITIAL_SIZE 16384
+
+static int houserelays_writer_room (RelaysWriter *writer, int needed) {
+
+    if (writer->failed) return 0;
+
+    needed += writer->length + 1; // Always keep room for the terminator.
+    if (needed <= writer->size) return 1;
+
+    int size = writer->size ? writer->size : WRITER_INITIAL_SIZE;
+    while (size < needed) size *= 2;
+
+    char *buffer = realloc (writer->buffer, size);
+    if (!buffer) {
+        writer->failed = 1;
+        return 0;
+    }
+    writer->buffer = buffer;
+    writer->size = size;
+    return 1;
+}
+
+static void houserelays_writer_append (RelaysWriter *writer,
+                                       const char *text, int length) {
+
+    if (!houserelays_writer_room (writer, length)) return;
+    memcpy (writer->buffer + writer->length, text, length);
+    writer->length += length;
+}
+
+static void houserelays_writer_quoted (RelaysWriter *writer,
+                                       const char *text) {
+
+    static const char hex[] = "0123456789abcdef";
+
+    // Worst case: each character is escaped as \u00XX.
+    int length = strlen(text);
+    if (!houserelays_writer_room (writer, (6 * length) + 2)) return;
+
+    char *cursor = writer->buffer + writer->length;
+    *(cursor++) = '"';
+    for (; *text; ++text) {
+        unsigned char c = (unsigned char)(*text);
+        if ((c == '"') || (c == '\\')) {
+            *(cursor++) = '\\';
+            *(cursor++) = c;
+        } else if (c < 0x20) {
+            *(cursor++) = '\\';
+            *(cursor++) = 'u';
+            *(cursor++) = '0';
+            *(cursor++) = '0';
+            *(cursor++) = hex[c >> 4];
+            *(cursor++) = hex[c & 0xf];
+        } else {
+            *(cursor++) = c;
+        }
+    }
+    *(cursor++) = '"';
+    writer->length = cursor - writer->buffer;
+}
+
+static void houserelays_writer_key (RelaysWriter *writer, const char *key) {
+
+    if (writer->depth > 0) {
+        if (writer->count[writer->depth-1]++ > 0)
+            houserelays_writer_append (writer, ",", 1);
+    }
+    if (key) {
+        houserelays_writer_quoted (writer, key);
+        houserelays_writer_append (writer, ":", 1);
+    }
+}
+
+static void houserelays_writer_open (RelaysWriter *writer,
+                                     const char *key, char open, char close) {
+
+    if (writer->depth >= WRITER_DEPTH) {
+        writer->failed = 1;
+        return;
+    }
+    houserelays_writer_key (writer, key);
+    houserelays_writer_append (writer, &open, 1);
+    writer->closing[writer->depth] = close;
+    writer->count[writer->depth] = 0;
+    writer->depth += 1;
+}
+
+void houserelays_writer_start (RelaysWriter *writer) {
+    writer->length = 0;
+    writer->depth = 0;
+    writer->failed = 0;
+}
+
+void houserelays_writer_object (RelaysWriter *writer, const char *key) {
+    houserelays_writer_open (writer, key, '{', '}');
+}
+
+void houserelays_writer_array (RelaysWriter *writer, const char *key) {
+    houserelays_writer_open (writer, key, '[', ']');
+}
+
+void houserelays_writer_end (RelaysWriter *writer) {
+    if (writer->depth <= 0) return;
+    writer->depth -= 1;
+    houserelays_writer_append (writer, writer->closing + writer->depth, 1);
+}
+
+void houserelays_writer_string (RelaysWriter *writer,
+                                const char *key, const char *value) {
+    houserelays_writer_key (writer, key);
+    if (value)
+        houserelays_writer_quoted (writer, value);
+    else
+        houserelays_writer_append (writer, "null", 4);
+}
+
+void houserelays_writer_integer (RelaysWriter *writer,
+                                 const char *key, long long value) {
+    char ascii[32];
+    houserelays_writer_key (writer, key);
+    houserelays_writer_append
+        (writer, ascii, snprintf (ascii, sizeof(ascii), "%lld", value));
+}
+
+void houserelays_writer_bool (RelaysWriter *writer,
+                              const char *key, int value) {
+    houserelays_writer_key (writer, key);
+    if (value)
+        houserelays_writer_append (writer, "true", 4);
+    else
+        houserelays_writer_append (writer, "false", 5);
+}
+
+void houserelays_writer_base64 (RelaysWriter *writer, const char *key,
+                                const unsigned char *data, int length) {
+
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+    houserelays_writer_key (writer, key);
+    if (!houserelays_writer_room (writer, ((length + 2) / 3 * 4) + 2)) return;
+
+    char *cursor = writer->buffer + writer->length;
+    *(cursor++) = '"';
+    int i;
+    for (i = 0; i < length; i += 3) {
+        unsigned int group = data[i] << 16;
+        if (i + 1 < length) group |= data[i+1] << 8;
+        if (i + 2 < length) group |= data[i+2];
+        *(cursor++) = base64[(group >> 18) & 0x3f];
+        *(cursor++) = base64[(group >> 12) & 0x3f];
+        if (i + 1 < length) *(cursor++) = base64[(group >> 6) & 0x3f];
+        if (i + 2 < length) *(cursor++) = base64[group & 0x3f];
+    }
+    *(cursor++) = '"';
+    writer->length = cursor - writer->buffer;
+}
+
+const char *houserelays_writer_export (RelaysWriter *writer) {
+
+    while (writer->depth > 0) houserelays_writer_end (writer);
+    if (!houserelays_writer_room (writer, 0)) return 0;
+    writer->buffer[writer->length] = 0;
+    return writer->buffer;
+}
+
+int houserelays_writer_length (const RelaysWriter *writer) {
+    return writer->length;
+}
@@ -0,0 +1,49 @@
+/* houserelays - A simple home web server for world domination through relays
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ * houserelays_writer.h - Write a JSON response as data is visited.
+ */
+#define WRITER_DEPTH 16
+
+typedef struct {
+    char *buffer;
+    int   size;
+    int   length;
+    int   failed;
+    int   depth;
+    char  closing[WRITER_DEPTH];
+    int   count[WRITER_DEPTH];
+} RelaysWriter;
+
+void houserelays_writer_start  (RelaysWriter *writer);
+void houserelays_writer_object (RelaysWriter *writer, const char *key);
+void houserelays_writer_array  (RelaysWriter *writer, const char *key);
+void houserelays_writer_end    (RelaysWriter *writer);
+
+void houserelays_writer_string  (RelaysWriter *writer,
+                                 const char *key, const char *value);
+void houserelays_writer_integer (RelaysWriter *writer,
+                                 const char *key, long long value);
+void houserelays_writer_bool    (RelaysWriter *writer,
+                                 const char *key, int value);
+void houserelays_writer_base64  (RelaysWriter *writer, const char *key,
+                                 const unsigned char *data, int length);
+
+const char *houserelays_writer_export (RelaysWriter *writer);
+int houserelays_writer_length (const RelaysWriter *writer);